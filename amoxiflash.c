@@ -21,13 +21,16 @@ For more information, contact bushing@gmail.com, or see http://code.google.com/p
 #define VERSION "0.5"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <inttypes.h>
 #include <usb.h>
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include "amoxiflash.h"
 
 #ifdef __MINGW32__
@@ -52,29 +55,69 @@ For more information, contact bushing@gmail.com, or see http://code.google.com/p
 #define NAND_READ_POST 0x30
 #define NAND_WRITE_PRE 0x80
 #define NAND_WRITE_POST 0x10
-
-#define PAGEBUF_SIZE 4096
-
-usb_dev_handle *locate_infectus(void);
+#define NAND_READ_CACHE 0x31
+#define NAND_READ_CACHE_END 0x3f
+#define NAND_WRITE_CACHE 0x15
+#define NAND_WRITE_PLANE 0x11
+#define NAND_READ_PARAMS 0xec
+
+#define QUEUE_DEPTH_MAX 32
+#define BATCH_REPLIES_MAX 32
+#define GANG_MAX 32
+
+usb_dev_handle *locate_infectus(const char *spec);
+int find_infectus(const char *spec, struct usb_device **devs, int max);
+static void infectus_devname(struct usb_device *dev, char *buf, int len);
+void list_infectus(void);
+void wait_flash(void);
+struct manifest *get_manifest(const char *filename);
 
 struct usb_dev_handle *h;
+struct transport *transport;
+char *sim_spec = NULL;
+char *device_spec = NULL;
+char device_id[64] = "sim";	/* serial number or bus:address */
+int infectus_revision, infectus_loader, infectus_pld;
 struct timeval tv1, tv2;
 char *progname;
 
 int run_fast = 0;
 int subpage_size = 0x2c0;
+int subpage_size_set = 0;
 int page_size = 2048;
 int spare_size = 64;
 int num_blocks = 4096;
 int pages_per_block = 64;
+int pagebuf_size = 4224;	/* see set_geometry() */
 int verify_after_write = 1;
 int chip_select = 0;
+int num_chips = 1;		/* 2 with -x both */
+int current_chip = 0;
+int chip_pending[2];		/* erase / program not yet waited for (-w) */
 int force = 0;
 int debug_mode = 0;
 int test_mode = 0;
 int check_status = 0;
 int start_block = 0;
 int quick_check = 0;
+int queue_depth = 1;
+int erase_all = 0;
+enum { CACHE_AUTO, CACHE_ON, CACHE_OFF };
+int cache_mode = CACHE_AUTO;
+int cache_read = 0;		/* 31h/3Fh for runs of pages */
+int cache_program = 0;		/* whole pages with 15h */
+int multi_plane_allowed = 1;
+int multi_plane = 0;		/* erase / program block pairs across planes */
+int jobs = 1;
+int jobs_set = 0;
+int reread_tries = 3;
+int make_manifest = 0;
+char *base_filename = NULL;
+char *server_path = NULL;	/* -D */
+int image_format = IMAGE_RAW;	/* -F, for dump and convert */
+const char *image_format_names[] = { "raw", "sparse", "zlib" };
+int resume = 0;			/* -R */
+int coalesce = 0;
 
 u32 start_time = 0;
 u32 blocks_done = 0;
@@ -99,6 +142,8 @@ static const char *pld_ids[] = {
       "XDowngrader"
 };
 
+const struct chip_type *chip_type;	/* what the selected chip is */
+const struct chip_type *chip_override = NULL;	/* -g */
 
 void timer_start(void) {
 	gettimeofday(&tv1, NULL);
@@ -137,6 +182,9 @@ void hexdump(void *d, int len) {
 }
 
 int infectus_sendcommand(u8 *buf, int len, int maxsize) {
+	int key = profiling ? profile_key(buf) : 0;
+	u64 start = profiling ? profile_now() : 0;
+
 	if (debug_mode) {
 		printf("> "); hexdump(buf, len);
 	}
@@ -144,9 +192,9 @@ int infectus_sendcommand(u8 *buf, int len, int maxsize) {
 	int ret = 0;
 start:
 		while (ret < len) {
-		ret = usb_bulk_write(h, ENDPOINT_WRITE, (char *)buf, len, 500);
+		ret = transport->bulk_write(buf, len, 500);
 		if (ret < 0) {
-			printf("Error %d sending command: %s\n", ret, usb_strerror());
+			printf("Error %d sending command: %s\n", ret, transport->strerror());
 			return ret;
 		}
 		if (ret != len) {
@@ -154,7 +202,7 @@ start:
 		}
 	}
 
-	ret=usb_bulk_read(h, ENDPOINT_READ, (char *)buf, maxsize, 500);	
+	ret=transport->bulk_read(buf, maxsize, 500);
 	if(ret < 0) {
 		printf("Error reading reply: %d\n", ret);
 		return ret;		
@@ -172,24 +220,269 @@ start:
 	buf++; // skip initial FF
 	
 	if (debug_mode && ret > 0) hexdump(buf, ret);
+	if (profiling) profile_record(key, len, ret, start);
 //	usleep(1000);
 	return ret;
 }
 
-int infectus_nand_command(u8 *command, unsigned int len, ...) {
+/* Pipelined command queue.  infectus_submit() writes a command straight away
+   and leaves a slot for its reply; a reader thread fills the slots in order,
+   and infectus_reap() hands back the oldest one.  Up to queue_depth commands
+   can be outstanding, so the device never waits for us to ask for the next
+   reply before it can start on the next command. */
+struct queued_reply {
+	u8 buf[PAGEBUF_MAX];
+	int maxsize;
+	int ret;
+	int done;
+	int key, len;		/* for the profile */
+	u64 start;		/* when the command went out */
+};
+
+static struct queued_reply reply_queue[QUEUE_DEPTH_MAX];
+static unsigned int queue_submitted, queue_read, queue_reaped;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t queue_reader;
+static int queue_running = 0;
+
+static void *queue_reader_thread(void *arg) {
+	struct queued_reply *r;
+	int ret;
+
+	pthread_mutex_lock(&queue_lock);
+	for (;;) {
+		while (queue_read == queue_submitted)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		r = &reply_queue[queue_read % QUEUE_DEPTH_MAX];
+		pthread_mutex_unlock(&queue_lock);
+
+		do {
+			ret = transport->bulk_read(r->buf, r->maxsize, 500);
+			if (ret < 0) {
+				printf("Error reading reply: %d\n", ret);
+				break;
+			}
+			if (debug_mode) {
+				printf("< ");
+				hexdump(r->buf, ret);
+			}
+			if (r->buf[0] != 0xFF)
+				printf("Reply began with %02x, expected ff\n", r->buf[0]);
+		} while (r->buf[0] != 0xFF);
+
+		if (profiling && ret >= 0) profile_record(r->key, r->len, ret, r->start);
+		pthread_mutex_lock(&queue_lock);
+		r->ret = ret;
+		r->done = 1;
+		queue_read++;
+		pthread_cond_broadcast(&queue_cond);
+	}
+	return NULL;
+}
+
+int infectus_submit(u8 *buf, int len, int maxsize) {
+	struct queued_reply *r;
+	int ret, key = profiling ? profile_key(buf) : 0;
+	u64 start;
+
+	if (!queue_running) {
+		pthread_create(&queue_reader, NULL, queue_reader_thread, NULL);
+		queue_running = 1;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	while (queue_submitted - queue_reaped >= queue_depth)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	pthread_mutex_unlock(&queue_lock);
+
+	if (debug_mode) {
+		printf("> "); hexdump(buf, len);
+	}
+	start = profiling ? profile_now() : 0;
+	ret = transport->bulk_write(buf, len, 500);
+	if (ret < 0) {
+		printf("Error %d sending command: %s\n", ret, transport->strerror());
+		return ret;
+	}
+	if (ret != len) printf("Error: short write (%d < %d)\n", ret, len);
+
+	pthread_mutex_lock(&queue_lock);
+	r = &reply_queue[queue_submitted % QUEUE_DEPTH_MAX];
+	r->maxsize = maxsize > PAGEBUF_MAX ? PAGEBUF_MAX : maxsize;
+	r->done = 0;
+	r->key = key;
+	r->len = len;
+	r->start = start;
+	queue_submitted++;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return ret;
+}
+
+/* Wait for the oldest outstanding reply and copy its payload (without the
+   leading FF) to dst.  Returns the length including the FF, like
+   infectus_sendcommand(). */
+int infectus_reap(u8 *dst, int dstlen) {
+	struct queued_reply *r;
+	int ret;
+
+	pthread_mutex_lock(&queue_lock);
+	r = &reply_queue[queue_reaped % QUEUE_DEPTH_MAX];
+	while (!r->done)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	pthread_mutex_unlock(&queue_lock);
+
+	ret = r->ret;
+	if (dst && ret > 1) memcpy(dst, r->buf + 1, ret - 1 < dstlen ? ret - 1 : dstlen);
+
+	pthread_mutex_lock(&queue_lock);
+	queue_reaped++;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return ret;
+}
+
+static int infectus_nand_vcommand(u8 *command, unsigned int len, va_list ap) {
 	int i;
-	va_list ap;
-    va_start(ap, len);
 	memset(command, 0, len+9);
 	command[0]=INFECTUS_NAND_CMD;
 	command[7]=len;
 	for(i=0; i<=len; i++) {
 		command[i+8]=va_arg(ap,int) & 0xff;
 	}
-    va_end(ap);
 	return len+9;
 }
 
+int infectus_nand_command(u8 *command, unsigned int len, ...) {
+	int ret;
+	va_list ap;
+    va_start(ap, len);
+	ret = infectus_nand_vcommand(command, len, ap);
+    va_end(ap);
+	return ret;
+}
+
+/* Command batches: several packets are packed into a single bulk write and
+   the replies, which come back in order, are split up again by their
+   expected lengths.  Only used when the firmware passed
+   infectus_probe_batch(). */
+struct cmd_batch {
+	u8 buf[2*PAGEBUF_MAX];
+	int len;
+	int nreplies;
+	int reply_len[BATCH_REPLIES_MAX];	/* expected, including the FF */
+	u8 *reply_dst[BATCH_REPLIES_MAX];
+};
+
+void batch_init(struct cmd_batch *b) {
+	b->len = 0;
+	b->nreplies = 0;
+}
+
+static void batch_expect(struct cmd_batch *b, int len, u8 *dst) {
+	b->reply_len[b->nreplies] = len;
+	b->reply_dst[b->nreplies] = dst;
+	b->nreplies++;
+}
+
+void batch_nand_command(struct cmd_batch *b, unsigned int len, ...) {
+	va_list ap;
+	va_start(ap, len);
+	b->len += infectus_nand_vcommand(b->buf + b->len, len, ap);
+	va_end(ap);
+	batch_expect(b, 1, NULL);
+}
+
+/* Read len bytes from the Infectus buffer into dst */
+void batch_nand_receive(struct cmd_batch *b, u8 *dst, int len) {
+	u8 *p = b->buf + b->len;
+	memset(p, 0, 8);
+	p[0] = INFECTUS_NAND_CMD;
+	p[1] = INFECTUS_NAND_RECV;
+	p[6] = (len >> 8) & 0xff;
+	p[7] = len & 0xff;
+	b->len += 8;
+	batch_expect(b, len + 1, dst);
+}
+
+/* Write len bytes from src into the Infectus buffer */
+void batch_nand_send(struct cmd_batch *b, u8 *src, int len) {
+	u8 *p = b->buf + b->len;
+	memset(p, 0, 8);
+	p[0] = INFECTUS_NAND_CMD;
+	p[1] = INFECTUS_NAND_SEND;
+	p[6] = len/256;
+	p[7] = len%256;
+	memcpy(p + 8, src, len);
+	b->len += len + 8;
+	batch_expect(b, 1, NULL);
+}
+
+/* Send the batch and collect every reply.  Returns the number of replies
+   received intact, which is b->nreplies on success. */
+int batch_run(struct cmd_batch *b, int timeout) {
+	u8 rbuf[2*PAGEBUF_MAX];
+	int have = 0, used, ret, i, want, payload, received = 0;
+	u64 start = profiling ? profile_now() : 0;
+
+	if (debug_mode) {
+		printf("> "); hexdump(b->buf, b->len);
+	}
+	ret = transport->bulk_write(b->buf, b->len, timeout);
+	if (ret < 0) {
+		printf("Error %d sending command batch: %s\n", ret, transport->strerror());
+		return ret;
+	}
+	if (ret != b->len) printf("Error: short write (%d < %d)\n", ret, b->len);
+
+	/* The firmware may return one transfer per reply or several replies run
+	   together; either way they are consumed strictly in order. */
+	for (i = 0; i < b->nreplies; i++) {
+		want = b->reply_len[i];
+		while (have < want) {
+			ret = transport->bulk_read(rbuf + have, sizeof rbuf - have, timeout);
+			if (ret < 0) return i;
+			if (debug_mode) {
+				printf("< "); hexdump(rbuf + have, ret);
+			}
+			have += ret;
+			received += ret;
+		}
+		if (rbuf[0] != 0xFF) {
+			printf("Reply %d began with %02x, expected ff\n", i, rbuf[0]);
+			return i;
+		}
+		if (b->reply_dst[i]) {
+			payload = want - 1;
+			memcpy(b->reply_dst[i], rbuf + 1, payload);
+		}
+		used = want;
+		memmove(rbuf, rbuf + used, have - used);
+		have -= used;
+	}
+	if (profiling) profile_record(PROFILE_BATCH, b->len, received, start);
+	return i;
+}
+
+/* Find out whether the firmware will take more than one packet per bulk
+   write: send a status query and its data read together, and see if both
+   replies come back.  Anything left over is drained before returning. */
+int infectus_probe_batch(void) {
+	struct cmd_batch b;
+	u8 status = 0, junk[PAGEBUF_MAX];
+	int ok;
+
+	batch_init(&b);
+	batch_nand_command(&b, 0, NAND_GETSTATUS);
+	batch_nand_receive(&b, &status, 1);
+	ok = batch_run(&b, 200) == b.nreplies;
+	while (transport->bulk_read(junk, sizeof junk, 50) > 0)
+		;
+	if (debug_mode) printf("batch probe: %s, status %02x\n", ok ? "ok" : "failed", status);
+	return ok;
+}
+
 int infectus_nand_receive(u8 *buf, int len) {
 	memset(buf, 0, 8);
 	buf[0] = INFECTUS_NAND_CMD;
@@ -199,8 +492,10 @@ int infectus_nand_receive(u8 *buf, int len) {
 	return infectus_sendcommand(buf, 8, len+3);
 }
 
-int infectus_nand_send(u8 *buf, int len) {
-	u8 temp_buf[PAGEBUF_SIZE];
+/* buf may point straight into a read-only image mapping, so the reply
+   (just the status byte) is not copied back over it */
+int infectus_nand_send(const u8 *buf, int len) {
+	u8 temp_buf[PAGEBUF_MAX];
 	memset(temp_buf, 0, sizeof temp_buf);
 
 	memcpy(temp_buf, "\x4e\x01\x00\x00\x00\x00", 8);
@@ -208,14 +503,14 @@ int infectus_nand_send(u8 *buf, int len) {
 	temp_buf[7] = len%256;
 	memcpy(temp_buf+8, buf, len);
 	
-	int retval = infectus_sendcommand(temp_buf, len+8, PAGEBUF_SIZE);
+	int retval = infectus_sendcommand(temp_buf, len+8, PAGEBUF_MAX);
 	if (retval < 0) return retval;
 	if (retval > len) retval = len - 1;
-	memcpy(buf, temp_buf, retval);
 	return retval;
 }
 
-int infectus_reset(void) {
+/* USB transport: the Infectus on the global handle h */
+static int usb_transport_reset(void) {
 	u8 buf[128];
 	int ret;
 	
@@ -241,6 +536,39 @@ int infectus_reset(void) {
 	ret = usb_control_msg(h, USB_TYPE_VENDOR + USB_RECIP_DEVICE, 
 		2, 2, 0, (char *)buf, 0, 1000);
 	if (ret) printf("usb_control_msg(2)=%d\n", ret);
+	return 0;
+}
+
+static int usb_transport_write(u8 *buf, int len, int timeout) {
+	return usb_bulk_write(h, ENDPOINT_WRITE, (char *)buf, len, timeout);
+}
+
+static int usb_transport_read(u8 *buf, int len, int timeout) {
+	return usb_bulk_read(h, ENDPOINT_READ, (char *)buf, len, timeout);
+}
+
+static const char *usb_transport_strerror(void) {
+	return usb_strerror();
+}
+
+static void usb_transport_close(void) {
+	usb_close(h);
+}
+
+struct transport usb_transport = {
+	"usb",
+	usb_transport_reset,
+	usb_transport_write,
+	usb_transport_read,
+	usb_transport_strerror,
+	usb_transport_close
+};
+
+int infectus_reset(void) {
+	u8 buf[128];
+	int ret;
+
+	transport->reset();
 
 	/* Send Infectus reset command */
 	ret = 0;
@@ -259,6 +587,7 @@ int infectus_get_version(void) {
 
 	ret=infectus_sendcommand(buf, 8, 128);
 	printf("Infectus version (?) = %hhx\n", buf[1]);
+	infectus_revision = buf[1];
 //	hexdump(buf, ret);
 	return 0;
 }
@@ -271,6 +600,7 @@ int infectus_get_loader_version(void) {
 
 	ret = infectus_sendcommand(buf, 8, 128);
 	printf("Infectus Loader version = %hhu.%hhu\n", buf[1], buf[2]);
+	infectus_loader = buf[1] << 8 | buf[2];
 //	hexdump(buf, ret);
 	return 0;
 }
@@ -282,6 +612,7 @@ int infectus_check_pld_id(void) {
 
 	ret = infectus_sendcommand(buf, 8, 128);
 	if (ret < 0) return ret;
+	infectus_pld = buf[1];
 	if (buf[1] > (sizeof pld_ids)/4) {
 		fprintf(stderr, "Unknown PLD ID %d\n", buf[1]);
 	} else {
@@ -304,6 +635,19 @@ int infectus_selectflash(int which) {
 	return 0;
 }
 
+/* Point NAND commands at chip which, if they aren't already.  With -w, an
+   erase or program left running on that chip is waited for first. */
+void select_chip(int which) {
+	if (which != current_chip) {
+		infectus_selectflash(which);
+		current_chip = which;
+	}
+	if (chip_pending[which]) {
+		wait_flash();
+		chip_pending[which] = 0;
+	}
+}
+
 /* Get NAND flash chip status */
 int infectus_getstatus(void) {
 	u8 buf[128];
@@ -319,16 +663,39 @@ int infectus_getstatus(void) {
 
 /* Wait for NAND flash to be ready */
 void wait_flash(void) {
-	int status=0;
+	int status=0, prev = profile_enter(PHASE_STATUS);
 	while (status != 0xe0) {
 		status = infectus_getstatus();
 		if(status != 0xe0) printf("Status = %x\n", status);
 	}
+	profile_leave(prev);
+}
+
+/* After an erase or program: with -w, wait for the chip to finish.  When
+   both chips are in use the wait is put off until the chip is next
+   selected, so the other chip can be driven in the meantime. */
+void flash_done(void) {
+	if (!check_status) return;
+	if (num_chips > 1) chip_pending[current_chip] = 1;
+	else wait_flash();
+}
+
+/* Read count ID bytes from address addr: 00h for the chip ID, 20h for
+   the ONFI signature */
+int infectus_readid(u8 *dst, int addr, int count) {
+	u8 buf[128];
+	int ret,len;
+
+	len=infectus_nand_command(buf, 1, NAND_CHIPID, addr);
+	ret=infectus_sendcommand(buf, len, 128);
+
+	ret = infectus_nand_receive(buf, count);
+	memcpy(dst, buf + 1, count);
+	return ret - 1;
 }
 
-/* Query the first two bytes of the NAND flash chip ID.
-   Eventually, this should be used to select the appropriate parameters
-   to be used when talking to this chip. */
+/* Query the first two bytes of the NAND flash chip ID.  The chip database
+   (chips.c) says what the chip is from there. */
 
 int infectus_getflashid(void) {
 	u8 buf[128];
@@ -337,21 +704,51 @@ int infectus_getflashid(void) {
 	len=infectus_nand_command(buf, 0, NAND_RESET);
 	ret=infectus_sendcommand(buf, len, 128);
 
-	len=infectus_nand_command(buf, 1, NAND_CHIPID, 0);
-	ret=infectus_sendcommand(buf, len, 128);
-
-	infectus_nand_receive(buf, 2);
+	infectus_readid(buf, 0, 2);
 	
-	return buf[1] << 8 | buf[2];
+	return buf[0] << 8 | buf[1];
+}
+
+/* Read the ONFI parameter page (ECh) with its redundant copies into dst,
+   ONFI_PARAM_COPIES * ONFI_PARAM_LEN bytes.  Returns the length read. */
+int infectus_readparams(u8 *dst) {
+	u8 buf[128], flash_buf[PAGEBUF_MAX];
+	int ret, len, n, total = ONFI_PARAM_COPIES * ONFI_PARAM_LEN;
+
+	len=infectus_nand_command(buf, 1, NAND_READ_PARAMS, 0);
+	ret = infectus_sendcommand(buf, len, 128);
+
+	for (len = 0; len < total; len += n) {
+		n = total - len < subpage_size ? total - len : subpage_size;
+		ret = infectus_nand_receive(flash_buf, n);
+		if (ret != n + 1) break;
+		memcpy(dst + len, flash_buf + 1, n);
+	}
+	/* back to reading the array */
+	infectus_getflashid();
+	return len;
 }
 
 /* Erase a block of flash memory. */
 int infectus_eraseblock(unsigned int blockno) {
 	u8 buf[128];
 	unsigned int pageno = blockno * pages_per_block;
-	int ret, len;
+	int ret, len, prev;
 
 	if (test_mode) return 0;
+	prev = profile_enter(PHASE_ERASE);
+
+	if (coalesce) {
+		struct cmd_batch b;
+		batch_init(&b);
+		batch_nand_command(&b, 3, NAND_ERASE_PRE, pageno, pageno >> 8, pageno >> 16);
+		batch_nand_command(&b, 0, NAND_ERASE_POST);
+		ret = batch_run(&b, 500);
+		if (ret != b.nreplies) printf("Erase batch returned %d of %d replies\n", ret, b.nreplies);
+		flash_done();
+		profile_leave(prev);
+		return 1;
+	}
 	
 	len=infectus_nand_command(buf, 3, NAND_ERASE_PRE, pageno, pageno >> 8, pageno >> 16);
 	ret = infectus_sendcommand(buf, len, 128);
@@ -360,15 +757,73 @@ int infectus_eraseblock(unsigned int blockno) {
 	len=infectus_nand_command(buf, 0, NAND_ERASE_POST);
 	ret = infectus_sendcommand(buf, len, 128);
 	
-	if (check_status) wait_flash();
+	flash_done();
+	profile_leave(prev);
+	return ret;
+}
+
+/* Multi-plane erase of blockno (even) and blockno + 1, in one tBERS */
+int infectus_eraseplanes(unsigned int blockno) {
+	u8 buf[128];
+	unsigned int page0 = blockno * pages_per_block, page1 = page0 + pages_per_block;
+	int ret, len, prev;
+
+	if (test_mode) return 0;
+	prev = profile_enter(PHASE_ERASE);
+
+	if (coalesce) {
+		struct cmd_batch b;
+		batch_init(&b);
+		batch_nand_command(&b, 3, NAND_ERASE_PRE, page0, page0 >> 8, page0 >> 16);
+		if (chip_type->plane_erase) batch_nand_command(&b, 0, chip_type->plane_erase);
+		batch_nand_command(&b, 3, NAND_ERASE_PRE, page1, page1 >> 8, page1 >> 16);
+		batch_nand_command(&b, 0, NAND_ERASE_POST);
+		ret = batch_run(&b, 500);
+		if (ret != b.nreplies) printf("Erase batch returned %d of %d replies\n", ret, b.nreplies);
+		flash_done();
+		profile_leave(prev);
+		return 1;
+	}
+
+	len=infectus_nand_command(buf, 3, NAND_ERASE_PRE, page0, page0 >> 8, page0 >> 16);
+	ret = infectus_sendcommand(buf, len, 128);
+	if (chip_type->plane_erase) {
+		len=infectus_nand_command(buf, 0, chip_type->plane_erase);
+		ret = infectus_sendcommand(buf, len, 128);
+	}
+	len=infectus_nand_command(buf, 3, NAND_ERASE_PRE, page1, page1 >> 8, page1 >> 16);
+	ret = infectus_sendcommand(buf, len, 128);
+	if (ret!=1) printf("Erase command returned %d\n", ret);
+
+	len=infectus_nand_command(buf, 0, NAND_ERASE_POST);
+	ret = infectus_sendcommand(buf, len, 128);
+
+	flash_done();
+	profile_leave(prev);
 	return ret;
 }
 
 
 int infectus_readflashpage(u8 *dstbuf, unsigned int pageno) {
 	u8 buf[128];
-	u8 flash_buf[PAGEBUF_SIZE];
+	u8 flash_buf[PAGEBUF_MAX];
 	int ret, len, subpage;
+	int nsub = ceil((float)(page_size + spare_size) / subpage_size);
+
+	if (coalesce && nsub + 2 <= BATCH_REPLIES_MAX) {
+		struct cmd_batch b;
+		batch_init(&b);
+		batch_nand_command(&b, 5, NAND_READ_PRE, 0, 0, pageno, pageno >> 8, pageno >> 16);
+		batch_nand_command(&b, 0, NAND_READ_POST);
+		for(subpage = 0; subpage < nsub; subpage++)
+			batch_nand_receive(&b, dstbuf + subpage*subpage_size, subpage_size);
+		ret = batch_run(&b, 500);
+		if (ret != b.nreplies) {
+			printf("Readpage batch returned %d of %d replies\n", ret, b.nreplies);
+			return ret < 2 ? 0 : (ret - 2) * subpage_size;
+		}
+		return nsub * subpage_size;
+	}
 	
 	len=infectus_nand_command(buf, 5, NAND_READ_PRE, 0, 
 		0, pageno, pageno >> 8, pageno >> 16);
@@ -378,7 +833,7 @@ int infectus_readflashpage(u8 *dstbuf, unsigned int pageno) {
 	ret = infectus_sendcommand(buf, len, 128);
 	
 	len = 0;
-	for(subpage = 0; subpage < ceil((float)(page_size + spare_size) / subpage_size); subpage++) {
+	for(subpage = 0; subpage < nsub; subpage++) {
 		ret = infectus_nand_receive(flash_buf, subpage_size);
 		if (ret!= (subpage_size+1)) printf("Readpage returned %d\n", ret);
 		memcpy(dstbuf + subpage*subpage_size, flash_buf+1, subpage_size);
@@ -387,14 +842,191 @@ int infectus_readflashpage(u8 *dstbuf, unsigned int pageno) {
 	return len;
 }
 
-int file_readflashpage(FILE *fp, u8 *dstbuf, unsigned int pageno) {
-	fseeko(fp, pageno * (page_size + spare_size), SEEK_SET);
-	return fread(dstbuf, 1, page_size + spare_size, fp);
+/* Read count bytes of a page from column onwards (at most one subpage),
+   by starting the page read there.  Returns the number of bytes read. */
+int infectus_readcolumn(u8 *dstbuf, unsigned int pageno, int column, int count) {
+	u8 buf[128];
+	u8 flash_buf[PAGEBUF_MAX];
+	int ret, len;
+
+	if (coalesce) {
+		struct cmd_batch b;
+		batch_init(&b);
+		batch_nand_command(&b, 5, NAND_READ_PRE, column, column >> 8,
+			pageno, pageno >> 8, pageno >> 16);
+		batch_nand_command(&b, 0, NAND_READ_POST);
+		batch_nand_receive(&b, dstbuf, count);
+		ret = batch_run(&b, 500);
+		if (ret != b.nreplies) {
+			printf("Readcolumn batch returned %d of %d replies\n", ret, b.nreplies);
+			return 0;
+		}
+		return count;
+	}
+
+	len=infectus_nand_command(buf, 5, NAND_READ_PRE, column, column >> 8,
+		pageno, pageno >> 8, pageno >> 16);
+	ret = infectus_sendcommand(buf, len, 128);
+
+	len=infectus_nand_command(buf, 0, NAND_READ_POST);
+	ret = infectus_sendcommand(buf, len, 128);
+
+	ret = infectus_nand_receive(flash_buf, count);
+	if (ret != count + 1) {
+		printf("Readcolumn returned %d\n", ret);
+		return ret > 0 ? ret - 1 : 0;
+	}
+	memcpy(dstbuf, flash_buf + 1, count);
+	return count;
+}
+
+/* Read just the spare area of a page */
+int infectus_readspare(u8 *dstbuf, unsigned int pageno) {
+	return infectus_readcolumn(dstbuf, pageno, page_size, spare_size);
+}
+
+/* Cache read of count consecutive pages: 00h/30h loads the first page, and
+   each 31h hands the loaded page to the cache register and starts loading
+   the next, so the array read overlaps the transfer of the page before;
+   3Fh hands over the last one.  One command per page instead of two.
+   Commands go out batched with -c, or with -p up to queue_depth at once. */
+static int infectus_cacheread(u8 *dstbuf, unsigned int pageno, int count, int *lens) {
+	u8 buf[128];
+	int nsub = ceil((float)(page_size + spare_size) / subpage_size);
+	int per_page = 1 + nsub, total = 2 + count * per_page;
+	int submitted, reaped, page, step, len, ret;
+
+	for (page = 0; page < count; page++) lens[page] = 0;
+
+	if (coalesce && nsub + 3 <= BATCH_REPLIES_MAX) {
+		struct cmd_batch b;
+		for (page = 0; page < count; page++) {
+			batch_init(&b);
+			if (page == 0) {
+				batch_nand_command(&b, 5, NAND_READ_PRE, 0, 0, pageno, pageno >> 8, pageno >> 16);
+				batch_nand_command(&b, 0, NAND_READ_POST);
+			}
+			batch_nand_command(&b, 0, page < count - 1 ? NAND_READ_CACHE : NAND_READ_CACHE_END);
+			for (step = 0; step < nsub; step++)
+				batch_nand_receive(&b, dstbuf + page * pagebuf_size + step * subpage_size,
+					subpage_size);
+			ret = batch_run(&b, 500);
+			if (ret != b.nreplies) {
+				/* the rest come back short and get read again */
+				printf("Cache read batch returned %d of %d replies\n", ret, b.nreplies);
+				infectus_getflashid();	/* resets the chip */
+				return -1;
+			}
+			lens[page] = nsub * subpage_size;
+		}
+		return 0;
+	}
+
+	for (submitted = reaped = 0; reaped < total; ) {
+		if (submitted < total && submitted - reaped < (queue_depth > 1 ? queue_depth : 1)) {
+			if (submitted == 0) {
+				len = infectus_nand_command(buf, 5, NAND_READ_PRE, 0, 0,
+					pageno, pageno >> 8, pageno >> 16);
+				ret = infectus_submit(buf, len, 128);
+			} else if (submitted == 1) {
+				len = infectus_nand_command(buf, 0, NAND_READ_POST);
+				ret = infectus_submit(buf, len, 128);
+			} else if ((submitted - 2) % per_page == 0) {
+				page = (submitted - 2) / per_page;
+				len = infectus_nand_command(buf, 0,
+					page < count - 1 ? NAND_READ_CACHE : NAND_READ_CACHE_END);
+				ret = infectus_submit(buf, len, 128);
+			} else {
+				memset(buf, 0, 8);
+				buf[0] = INFECTUS_NAND_CMD;
+				buf[1] = INFECTUS_NAND_RECV;
+				buf[6] = (subpage_size >> 8) & 0xff;
+				buf[7] = subpage_size & 0xff;
+				ret = infectus_submit(buf, 8, subpage_size + 3);
+			}
+			if (ret < 0) return ret;
+			submitted++;
+		} else {
+			page = (reaped - 2) / per_page;
+			step = (reaped - 2) % per_page;
+			if (reaped < 2 || step == 0) {
+				infectus_reap(NULL, 0);
+			} else {
+				ret = infectus_reap(dstbuf + page * pagebuf_size + (step - 1) * subpage_size,
+					subpage_size);
+				if (ret != (subpage_size+1)) printf("Readpage returned %d\n", ret);
+				if (ret > 0) lens[page] += ret - 1;
+			}
+			reaped++;
+		}
+	}
+	return 0;
+}
+
+/* Read count consecutive pages into dstbuf (pagebuf_size apart), keeping up
+   to queue_depth commands in flight so that one page's data phase overlaps
+   the next page's setup.  The length read for each page goes into lens. */
+int infectus_readflashpages(u8 *dstbuf, unsigned int pageno, int count, int *lens) {
+	u8 buf[128];
+	int nsub = ceil((float)(page_size + spare_size) / subpage_size);
+	int per_page = 2 + nsub;
+	int total = count * per_page;
+	int submitted, reaped, page, step, len, ret;
+
+	if (cache_read && count > 1) return infectus_cacheread(dstbuf, pageno, count, lens);
+	if (queue_depth <= 1) {
+		for (page = 0; page < count; page++)
+			lens[page] = infectus_readflashpage(dstbuf + page * pagebuf_size, pageno + page);
+		return 0;
+	}
+
+	for (page = 0; page < count; page++) lens[page] = 0;
+	for (submitted = reaped = 0; reaped < total; ) {
+		if (submitted < total && submitted - reaped < queue_depth) {
+			page = submitted / per_page;
+			step = submitted % per_page;
+			if (step == 0) {
+				len = infectus_nand_command(buf, 5, NAND_READ_PRE, 0, 0,
+					pageno + page, (pageno + page) >> 8, (pageno + page) >> 16);
+				ret = infectus_submit(buf, len, 128);
+			} else if (step == 1) {
+				len = infectus_nand_command(buf, 0, NAND_READ_POST);
+				ret = infectus_submit(buf, len, 128);
+			} else {
+				memset(buf, 0, 8);
+				buf[0] = INFECTUS_NAND_CMD;
+				buf[1] = INFECTUS_NAND_RECV;
+				buf[6] = (subpage_size >> 8) & 0xff;
+				buf[7] = subpage_size & 0xff;
+				ret = infectus_submit(buf, 8, subpage_size + 3);
+			}
+			if (ret < 0) return ret;
+			submitted++;
+		} else {
+			page = reaped / per_page;
+			step = reaped % per_page;
+			if (step < 2) {
+				infectus_reap(NULL, 0);
+			} else {
+				ret = infectus_reap(dstbuf + page * pagebuf_size + (step - 2) * subpage_size,
+					subpage_size);
+				if (ret != (subpage_size+1)) printf("Readpage returned %d\n", ret);
+				if (ret > 0) lens[page] += ret - 1;
+			}
+			reaped++;
+		}
+	}
+	return 0;
+}
+
+/* Page pageno of an image, in place; NULL past the end of the file */
+u8 *file_readflashpage(struct image *img, unsigned int pageno) {
+	return image_page(img, pageno);
 }
 
-int file_writeflashpage(FILE *fp, u8 *dstbuf, unsigned int pageno) {
-	fseeko(fp, pageno * (page_size + spare_size), SEEK_SET);
-	return fwrite(dstbuf, 1, (page_size + spare_size), fp);
+int file_writeflashpage(struct image *img, u8 *srcbuf, unsigned int pageno) {
+	if (image_write_page(img, pageno, srcbuf) < 0) return 0;
+	return page_size + spare_size;
 }
 
 int mem_compare(u8 *buf1, u8 *buf2, int size) {
@@ -403,11 +1035,12 @@ int mem_compare(u8 *buf1, u8 *buf2, int size) {
 	return i;
 }
 
-int flash_compare(FILE *fp, unsigned int pageno) {
-	u8 buf1[PAGEBUF_SIZE], buf2[PAGEBUF_SIZE];
-//	u8 buf3[PAGEBUF_SIZE];
+int flash_compare(struct image *img, unsigned int pageno) {
+	u8 *buf1, buf2[PAGEBUF_MAX];
+//	u8 buf3[PAGEBUF_MAX];
 	int x;
-	file_readflashpage(fp, buf1, pageno);
+	buf1 = file_readflashpage(img, pageno);
+	if (!buf1) return 1;
 	if (check_ecc(buf1)==ECC_WRONG) {
 		printf("warning, invalid ECC on disk for page %d\n", pageno);
 	}
@@ -427,6 +1060,20 @@ int flash_compare(FILE *fp, unsigned int pageno) {
 	return x;
 }
 
+/* -q: compare only the spare area, which carries the page's ECC.  When the
+   image page has valid ECC and the chip's spare area matches it, the data
+   is taken to match as well; anything else gets a full compare. */
+int flash_quick_compare(struct image *img, unsigned int pageno) {
+	u8 *buf1, spare[PAGEBUF_MAX];
+	buf1 = file_readflashpage(img, pageno);
+	if (!buf1) return 1;
+	if (check_ecc(buf1) != ECC_OK) return flash_compare(img, pageno);
+
+	if (infectus_readspare(spare, pageno) == spare_size &&
+	    !memcmp(buf1 + page_size, spare, spare_size)) return 0;
+	return flash_compare(img, pageno);
+}
+
 int flash_isFF(u8 *buf, int len) {
 	unsigned int *p = (unsigned int *)buf;
 	int i;
@@ -435,37 +1082,277 @@ int flash_isFF(u8 *buf, int len) {
 	return 1;
 }
 
-int infectus_writeflashpage(u8 *dstbuf, unsigned int pageno) {
+/* Read the spare areas of count pages into dst, spare_size apart: batched
+   with -c, or with -p up to queue_depth commands in flight.  Returns 0 if
+   every one was read whole. */
+int infectus_readspares(u8 *dst, unsigned int *pages, int count) {
 	u8 buf[128];
-	int ret, len, subpage;
+	int per_batch = BATCH_REPLIES_MAX / 3, submitted, reaped, step, len, ret, i, n;
+	unsigned int p;
+
+	if (coalesce) {
+		struct cmd_batch b;
+		for (i = 0; i < count; i += n) {
+			batch_init(&b);
+			for (n = 0; n < per_batch && i + n < count; n++) {
+				p = pages[i + n];
+				batch_nand_command(&b, 5, NAND_READ_PRE, page_size, page_size >> 8,
+					p, p >> 8, p >> 16);
+				batch_nand_command(&b, 0, NAND_READ_POST);
+				batch_nand_receive(&b, dst + (i + n) * spare_size, spare_size);
+			}
+			if (batch_run(&b, 500) != b.nreplies) return -1;
+		}
+		return 0;
+	}
+
+	if (queue_depth <= 1) {
+		for (i = 0; i < count; i++)
+			if (infectus_readspare(dst + i * spare_size, pages[i]) != spare_size) return -1;
+		return 0;
+	}
+
+	/* as infectus_readflashpages(): three steps a page */
+	for (submitted = reaped = 0, ret = 0; reaped < count * 3; ) {
+		if (submitted < count * 3 && submitted - reaped < queue_depth) {
+			p = pages[submitted / 3];
+			step = submitted % 3;
+			if (step == 0) {
+				len = infectus_nand_command(buf, 5, NAND_READ_PRE, page_size, page_size >> 8,
+					p, p >> 8, p >> 16);
+				if (infectus_submit(buf, len, 128) < 0) return -1;
+			} else if (step == 1) {
+				len = infectus_nand_command(buf, 0, NAND_READ_POST);
+				if (infectus_submit(buf, len, 128) < 0) return -1;
+			} else {
+				memset(buf, 0, 8);
+				buf[0] = INFECTUS_NAND_CMD;
+				buf[1] = INFECTUS_NAND_RECV;
+				buf[6] = (spare_size >> 8) & 0xff;
+				buf[7] = spare_size & 0xff;
+				if (infectus_submit(buf, 8, spare_size + 3) < 0) return -1;
+			}
+			submitted++;
+		} else {
+			if (reaped % 3 < 2) {
+				infectus_reap(NULL, 0);
+			} else if (infectus_reap(dst + reaped / 3 * spare_size, spare_size) != spare_size + 1) {
+				ret = -1;	/* drain the rest before giving up */
+			}
+			reaped++;
+		}
+	}
+	return ret;
+}
+
+/* For erase: a block is taken as blank if its first page is all FF, data
+   and spare, and so are the spare areas of a sample of the rest.  A block
+   written straight through (a raw image) shows in page 0.  The Wii writes
+   8-page clusters whole, with ECC in every page's spare area, so every 8th
+   page catches any cluster in use; the last page catches a block written
+   from the end.  This only beats erasing the block when the reads are
+   batched (-c) or queued (-p). */
+#define BLANK_CHECK_STRIDE 8
+
+int flash_block_blank(unsigned int blockno) {
+	int max = pages_per_block / BLANK_CHECK_STRIDE + 1;
+	u8 *spare = malloc(max * spare_size);
+	u8 *page = malloc(pagebuf_size);
+	unsigned int *pages = malloc(max * sizeof *pages);
+	int pageno, n = 0, i, blank = 1;
+
+	for (pageno = BLANK_CHECK_STRIDE; pageno < pages_per_block; pageno += BLANK_CHECK_STRIDE)
+		pages[n++] = blockno * pages_per_block + pageno;
+	if ((pageno - BLANK_CHECK_STRIDE) != pages_per_block - 1)
+		pages[n++] = blockno * pages_per_block + pages_per_block - 1;
+
+	if (infectus_readflashpage(page, blockno * pages_per_block) < page_size + spare_size ||
+	    !flash_isFF(page, page_size + spare_size))
+		blank = 0;
+	else if (infectus_readspares(spare, pages, n))
+		blank = 0;
+	for (i = 0; i < n && blank; i++)
+		if (!flash_isFF(spare + i * spare_size, spare_size)) blank = 0;
+	free(spare);
+	free(page);
+	free(pages);
+	return blank;
+}
+
+/* Program one subpage_size piece of a page */
+int infectus_writesubpage(u8 *dstbuf, unsigned int pageno, int subpage) {
+	u8 buf[128];
+	int ret, len, prev;
+	/* dstbuf may be an image mapping that ends with this page */
+	int n = page_size + spare_size - subpage * subpage_size;
 	
 	if (test_mode) return 0;
+	if (n > subpage_size) n = subpage_size;
+	prev = profile_enter(PHASE_PROGRAM);
+
+	if (coalesce) {
+		struct cmd_batch b;
+		batch_init(&b);
+		batch_nand_command(&b, 5, NAND_WRITE_PRE, subpage * subpage_size,
+			(subpage * subpage_size) >> 8 , pageno, pageno >> 8, pageno >> 16);
+		batch_nand_send(&b, dstbuf + subpage * subpage_size, n);
+		batch_nand_command(&b, 0, NAND_WRITE_POST);
+		ret = batch_run(&b, 500);
+		if (ret != b.nreplies) printf("Writepage batch returned %d of %d replies\n", ret, b.nreplies);
+		flash_done();
+		profile_leave(prev);
+		return 0;
+	}
 	
-	for(subpage = 0; subpage < ceil((float)(page_size + spare_size)/subpage_size); subpage++) {
-			len=infectus_nand_command(buf, 5, NAND_WRITE_PRE, subpage * subpage_size,
-				(subpage * subpage_size) >> 8 , pageno, pageno >> 8, pageno >> 16);
-			ret = infectus_sendcommand(buf, len, 128);
+	len=infectus_nand_command(buf, 5, NAND_WRITE_PRE, subpage * subpage_size,
+		(subpage * subpage_size) >> 8 , pageno, pageno >> 8, pageno >> 16);
+	ret = infectus_sendcommand(buf, len, 128);
 
-			infectus_nand_send(dstbuf + subpage * subpage_size, subpage_size);
+	infectus_nand_send(dstbuf + subpage * subpage_size, n);
+
+	len=infectus_nand_command(buf, 0, NAND_WRITE_POST);
+	ret = infectus_sendcommand(buf, len, 128);
 
-  			len=infectus_nand_command(buf, 0, NAND_WRITE_POST);
-			ret = infectus_sendcommand(buf, len, 128);
+	flash_done();
+	profile_leave(prev);
+	return 0;
+}
 
-		if (check_status) wait_flash();
+/* Load a whole page: setup (80h, or the second-plane setup) and the data
+   a subpage at a time, then confirm. */
+static int infectus_loadpage(u8 *dstbuf, unsigned int pageno, u8 setup, u8 confirm) {
+	u8 buf[128];
+	int ret, len, sub, n, page_len = page_size + spare_size;
+	int nsub = ceil((float)page_len / subpage_size);
+
+	if (coalesce && nsub + 2 <= BATCH_REPLIES_MAX) {
+		struct cmd_batch b;
+		batch_init(&b);
+		batch_nand_command(&b, 5, setup, 0, 0, pageno, pageno >> 8, pageno >> 16);
+		for (sub = 0; sub < nsub; sub++) {
+			n = page_len - sub * subpage_size;
+			batch_nand_send(&b, dstbuf + sub * subpage_size, n < subpage_size ? n : subpage_size);
+		}
+		batch_nand_command(&b, 0, confirm);
+		ret = batch_run(&b, 500);
+		if (ret != b.nreplies) printf("Page program batch returned %d of %d replies\n", ret, b.nreplies);
+	} else {
+		len=infectus_nand_command(buf, 5, setup, 0, 0, pageno, pageno >> 8, pageno >> 16);
+		ret = infectus_sendcommand(buf, len, 128);
+		for (sub = 0; sub < nsub; sub++) {
+			n = page_len - sub * subpage_size;
+			infectus_nand_send(dstbuf + sub * subpage_size, n < subpage_size ? n : subpage_size);
 		}
+		len=infectus_nand_command(buf, 0, confirm);
+		ret = infectus_sendcommand(buf, len, 128);
+	}
 	return 0;
 }
 
-int flash_program_block(FILE *fp, unsigned int blockno) {
-	u8 buf[PAGEBUF_SIZE];
-	unsigned long long usec;
-	int pageno, p, miscompares=0;
-	printf("\r                                                                     ");
-	printf("\r%04x", blockno); fflush(stdout);
-	timer_start();
+/* Cache program: load the whole page and confirm with 15h so the chip
+   takes the next page while this one programs.  The last page of a run is
+   confirmed with 10h instead. */
+int infectus_cacheprogram(u8 *dstbuf, unsigned int pageno, int last) {
+	int prev;
+	if (test_mode) return 0;
+	prev = profile_enter(PHASE_PROGRAM);
+	infectus_loadpage(dstbuf, pageno, NAND_WRITE_PRE, last ? NAND_WRITE_POST : NAND_WRITE_CACHE);
+	if (last) flash_done();
+	profile_leave(prev);
+	return 0;
+}
+
+/* Multi-plane program: page0 is held in its plane with 11h, and the
+   confirm after page1 (the same page of the other block) programs both.
+   last as for infectus_cacheprogram(). */
+int infectus_planeprogram(u8 *buf0, u8 *buf1, unsigned int page0, unsigned int page1, int last) {
+	int prev;
+	if (test_mode) return 0;
+	prev = profile_enter(PHASE_PROGRAM);
+	infectus_loadpage(buf0, page0, NAND_WRITE_PRE, NAND_WRITE_PLANE);
+	infectus_loadpage(buf1, page1, chip_type->plane_program,
+		last ? NAND_WRITE_POST : NAND_WRITE_CACHE);
+	if (last) flash_done();
+	profile_leave(prev);
+	return 0;
+}
+
+int infectus_writeflashpage(u8 *dstbuf, unsigned int pageno) {
+	int subpage;
+	for(subpage = 0; subpage < ceil((float)(page_size + spare_size)/subpage_size); subpage++) {
+		if (subpage && num_chips > 1) select_chip(current_chip);
+		infectus_writesubpage(dstbuf, pageno, subpage);
+	}
+	return 0;
+}
+
+/* Bad blocks are never erased or programmed, which would wipe the mark.
+   If the image has data for one, it is lost: say so. */
+static void skip_bad_block(struct image *img, int chip, unsigned int blockno) {
+	u8 *buf = image_block(img, blockno);
+	putchar('B');
+	if (buf && !flash_isFF(buf, pages_per_block * (page_size + spare_size)))
+		printf("\nWARNING: block %04x is bad on chip %d; its data in the image is not written\n",
+			blockno, chip);
+}
+
+/* Read back a page just written and say whether it matches */
+static void flash_verify(struct image *img, unsigned int pageno) {
+	int prev = profile_enter(PHASE_VERIFY);
+	putchar(flash_compare(img, pageno) ? '!' : '.');
+	fflush(stdout);
+	profile_leave(prev);
+}
+
+/* The programming half of flash_program_block() with cache program.
+   Verifying means reading, which waits for the array, so it is left until
+   the whole block is in. */
+static void flash_cache_program_block(struct image **imgs, int nchips, unsigned int blockno,
+                                      int *miscompares) {
+	u8 *buf;
+	int pageno, p, c, last[2];
+
+	for (c = 0; c < nchips; c++) {
+		last[c] = -1;
+		if (!miscompares[c]) continue;
+		for (pageno = 0; pageno < pages_per_block; pageno++) {
+			buf = file_readflashpage(imgs[c], blockno * pages_per_block + pageno);
+			if (buf && !flash_isFF(buf, page_size + spare_size)) last[c] = pageno;
+		}
+	}
+
+	for (pageno = 0; pageno < pages_per_block; pageno++) {
+		p = blockno*pages_per_block + pageno;
+		for (c = 0; c < nchips; c++) {
+			if (pageno > last[c]) continue;
+			buf = file_readflashpage(imgs[c], p);
+			if (flash_isFF(buf, page_size + spare_size)) {
+				putchar('F');
+				continue;
+			}
+			if (nchips > 1) select_chip(c);
+			infectus_cacheprogram(buf, p, pageno == last[c]);
+		}
+	}
+
+	for (pageno = 0; pageno < pages_per_block && verify_after_write; pageno++) {
+		p = blockno*pages_per_block + pageno;
+		for (c = 0; c < nchips; c++) {
+			if (pageno > last[c] || flash_isFF(file_readflashpage(imgs[c], p), page_size + spare_size))
+				continue;
+			if (nchips > 1) select_chip(c);
+			flash_verify(imgs[c], p);
+		}
+	}
+}
+
+/* Compare block blockno of the selected chip with the image, up to the
+   first page that differs.  Returns the number of miscompares (0 or 1). */
+static int flash_block_differs(struct image *img, unsigned int blockno) {
+	int pageno, p, miscompares = 0, prev = profile_enter(PHASE_COMPARE);
 	for(pageno = run_fast?2:0; pageno < pages_per_block; pageno += (run_fast?0x4:1)) {
 		p = blockno*pages_per_block + pageno;
-		if (flash_compare(fp, p)) {
+		if (quick_check ? flash_quick_compare(img, p) : flash_compare(img, p)) {
 			putchar('x');
 			miscompares++;
 // 			if (run_fast) break;   I can't think of a reason not to do this, so ...
@@ -473,7 +1360,12 @@ int flash_program_block(FILE *fp, unsigned int blockno) {
 			} else putchar('=');
 		fflush(stdout);
 	}
-	usec = timer_end();
+	profile_leave(prev);
+	return miscompares;
+}
+
+/* The end of the progress line, once the compare is done */
+static void flash_program_progress(unsigned int blockno, unsigned long long usec) {
 	float rate = (float)blocks_done / (time(NULL) - start_time);
 	int secs_remaining = (num_blocks - blockno) / rate;
 	if (blocks_done > 2) {
@@ -486,27 +1378,78 @@ int flash_program_block(FILE *fp, unsigned int blockno) {
 	} else putchar('\r');
 	if (debug_mode) fprintf(stderr, "Read(%.3f)", usec / 1000000.0f);
 	putchar('\r');
-	if (miscompares > 0) {
-//		printf("   %d miscompares in block\n", miscompares);
-		printf("Erasing...");
-		infectus_eraseblock(blockno);
-		printf("\nProg: ");
-		timer_start();
-		for(pageno = 0; pageno < pages_per_block; pageno++) {
-			p = blockno*pages_per_block + pageno;
-			if (file_readflashpage(fp, buf, p)==(page_size + spare_size)) {
-				if(flash_isFF(buf, (page_size + spare_size))) {
-					putchar('F');
-					continue;
-				}
-				infectus_writeflashpage(buf, p);
-				if (verify_after_write) {
-					if (flash_compare(fp, p)) {
-						putchar('!');
-					} else putchar('.');
-					fflush(stdout);
-				}
-			}
+}
+
+/* Bring block blockno of each chip in line with its image.  With one chip
+   (nchips == 1) the selected chip is used as is; with two, imgs[c] goes to
+   chip c and the work is interleaved so that one chip's erase or program
+   time is spent transferring to the other.  With compare == 0 the block is
+   already known to differ and is rewritten without reading it first. */
+int flash_program_block(struct image **imgs, int nchips, unsigned int blockno, int compare) {
+	u8 *buf;
+	unsigned long long usec;
+	int pageno, p, c, sub, any = 0;
+	int nsub = ceil((float)(page_size + spare_size) / subpage_size);
+	int miscompares[2] = { 0, 0 }, written[2];
+	printf("\r                                                                     ");
+	printf("\r%04x", blockno); fflush(stdout);
+	timer_start();
+	for (c = 0; c < nchips; c++) {
+		if (nchips > 1) {
+			select_chip(c);
+			printf(" %d:", c);
+		}
+		if (block_is_bad(c, blockno)) {
+			skip_bad_block(imgs[c], c, blockno);
+			continue;
+		}
+		if (!compare) {
+			miscompares[c] = 1;
+			any++;
+			continue;
+		}
+		miscompares[c] = flash_block_differs(imgs[c], blockno);
+		any += miscompares[c];
+	}
+	usec = timer_end();
+	flash_program_progress(blockno, usec);
+	if (any > 0) {
+//		printf("   %d miscompares in block\n", miscompares);
+		printf("Erasing...");
+		/* start every erase before waiting on any of them */
+		for (c = 0; c < nchips; c++) {
+			if (!miscompares[c]) continue;
+			if (nchips > 1) select_chip(c);
+			infectus_eraseblock(blockno);
+		}
+		printf("\nProg: ");
+		timer_start();
+		if (cache_program) flash_cache_program_block(imgs, nchips, blockno, miscompares);
+		else for(pageno = 0; pageno < pages_per_block; pageno++) {
+			p = blockno*pages_per_block + pageno;
+			for (c = 0; c < nchips; c++) {
+				written[c] = 0;
+				if (!miscompares[c] || !(buf = file_readflashpage(imgs[c], p))) continue;
+				if(flash_isFF(buf, (page_size + spare_size))) {
+					putchar('F');
+					continue;
+				}
+				written[c] = 1;
+			}
+			/* alternate chips every subpage, so each programs while the
+			   other is being loaded */
+			for (sub = 0; sub < nsub; sub++) {
+				for (c = 0; c < nchips; c++) {
+					if (!written[c]) continue;
+					if (nchips > 1) select_chip(c);
+					infectus_writesubpage(file_readflashpage(imgs[c], p), p, sub);
+				}
+			}
+			for (c = 0; c < nchips && verify_after_write; c++) {
+				if (!written[c]) continue;
+				if (nchips > 1) select_chip(c);
+				flash_verify(imgs[c], p);
+			}
 		}
 		usec = timer_end();
 		if (debug_mode) fprintf(stderr,"Write(%.3f)", usec / 1000000.0f);
@@ -517,26 +1460,235 @@ int flash_program_block(FILE *fp, unsigned int blockno) {
 	return 0;
 }
 
-int flash_dump_block(FILE *fp, unsigned int blockno) {
-	u8 buf[PAGEBUF_SIZE];
-	int pageno, p, ret;
+/* flash_program_block() for blockno (even) and blockno + 1 of a chip with
+   two planes.  If both need rewriting they are erased together and each
+   page is programmed in both planes at once, which halves the time spent
+   waiting for the array; otherwise the blocks go one at a time. */
+int flash_program_planes(struct image *img, unsigned int blockno, int compare) {
+	u8 *buf[2];
+	unsigned long long usec;
+	int pageno, b, last = -1, differs[2] = { 1, 1 };
+	unsigned int p[2];
+
+	if (block_is_bad(current_chip, blockno) || block_is_bad(current_chip, blockno + 1)) {
+		flash_program_block(&img, 1, blockno, compare);
+		flash_program_block(&img, 1, blockno + 1, compare);
+		return 0;
+	}
+
 	printf("\r                                                                     ");
 	printf("\r%04x", blockno); fflush(stdout);
+	timer_start();
+	for (b = 0; b < 2 && compare; b++) {
+		if (b) printf(" %04x", blockno + 1);
+		differs[b] = flash_block_differs(img, blockno + b);
+	}
+	usec = timer_end();
+	flash_program_progress(blockno, usec);
+	if (!differs[0] || !differs[1]) {
+		for (b = 0; b < 2; b++) {
+			if (differs[b]) flash_program_block(&img, 1, blockno + b, 0);
+			else blocks_done++;
+		}
+		return 0;
+	}
+
+	printf("Erasing...");
+	infectus_eraseplanes(blockno);
+	printf("\nProg: ");
+	timer_start();
+	for (pageno = 0; pageno < pages_per_block; pageno++)
+		for (b = 0; b < 2; b++) {
+			buf[b] = file_readflashpage(img, (blockno + b) * pages_per_block + pageno);
+			if (buf[b] && !flash_isFF(buf[b], page_size + spare_size)) last = pageno;
+		}
+	for (pageno = 0; pageno <= last; pageno++) {
+		for (b = 0; b < 2; b++) {
+			p[b] = (blockno + b) * pages_per_block + pageno;
+			buf[b] = file_readflashpage(img, p[b]);
+			if (buf[b] && flash_isFF(buf[b], page_size + spare_size)) buf[b] = NULL;
+		}
+		if (buf[0] && buf[1]) {
+			infectus_planeprogram(buf[0], buf[1], p[0], p[1], !cache_program || pageno == last);
+			continue;
+		}
+		/* a page to write in one plane only: on its own, ending any cache run */
+		putchar('F');
+		if (buf[0]) infectus_cacheprogram(buf[0], p[0], 1);
+		else if (buf[1]) infectus_cacheprogram(buf[1], p[1], 1);
+		else putchar('F');
+	}
+
+	for (b = 0; b < 2 && verify_after_write; b++)
+		for (pageno = 0; pageno <= last; pageno++) {
+			p[b] = (blockno + b) * pages_per_block + pageno;
+			buf[b] = file_readflashpage(img, p[b]);
+			if (!buf[b] || flash_isFF(buf[b], page_size + spare_size)) continue;
+			flash_verify(img, p[b]);
+		}
+	usec = timer_end();
+	if (debug_mode) fprintf(stderr,"Write(%.3f)", usec / 1000000.0f);
+	putchar('\r');
+	blocks_done += 2;
+	return 0;
+}
+
+/* Dump pipeline.  The USB stage (the calling thread) reads whole blocks
+   into a ring of buffers; a verifier thread runs check_ecc() on every page
+   and a writer thread copies the blocks into the output image and draws
+   the progress line.  The USB stage only ever waits for a free buffer,
+   never for the disk or the ECC check.  With both chips of a dual NAND
+   programmer in use, each block is read from chip 0 and then chip 1 and
+   the slots say which image they belong to.  With a journal, the writer
+   records each block that came through clean once it is on disk, and
+   blocks an earlier run recorded aren't read at all. */
+#define DUMP_RING_BLOCKS 8
+#define DUMP_REREAD_BUDGET 4096		/* page re-reads for a whole dump */
+
+struct dump_slot {
+	u32 blockno;
+	int chip;
+	int bad;		/* a bad block: no re-reads */
+	int resumed;		/* done by an earlier run: not read */
+	u8 *buf;		/* pages_per_block pages, pagebuf_size apart */
+	int *lens;
+	u8 *ecc;
+};
+
+struct dump_counts {
+	u32 ok, wrong, blank, invalid, short_reads, corrected, merged, resumed;
+};
+
+struct page_list {
+	u32 *pages;
+	u32 n, size;
+};
 
-	for(pageno = 0; pageno < pages_per_block; pageno++) {
+static void page_list_add(struct page_list *l, u32 pageno) {
+	if (l->n == l->size) {
+		l->size = l->size ? l->size * 2 : 64;
+		l->pages = realloc(l->pages, l->size * sizeof *l->pages);
+	}
+	l->pages[l->n++] = pageno;
+}
+
+static void page_list_print(const char *what, struct page_list *l) {
+	u32 i;
+	if (!l->n) return;
+	printf("%s (%u):", what, l->n);
+	for (i = 0; i < l->n; i++) printf("%s%x", i % 12 ? " " : "\n  ", l->pages[i]);
+	printf("\n");
+}
+
+struct dump_pipeline {
+	struct image *img[2];
+	struct journal *journal[2];
+	int nchips;
+	u32 first_block, end_block;
+	struct dump_slot ring[DUMP_RING_BLOCKS];
+	u32 read, verified, written;	/* blocks through each stage */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct dump_counts counts[2];
+	struct page_list corrected[2];	/* single-bit errors repaired */
+	struct page_list suspect[2];	/* still WRONG or short: read again */
+#define SUSPECT_SHORT 0x80000000	/* in suspect[]: a short read, not WRONG */
+	struct page_list lost[2];	/* no good copy after re-reading */
+	struct page_list untried[2];	/* not re-read: the budget ran out */
+	struct page_list merged[2];	/* rebuilt from several reads */
+};
+
+/* Block until the writer has handed back the oldest buffer.  What it has
+   written is read afresh each time round: it moves while we wait. */
+static void dump_wait_slot(struct dump_pipeline *d) {
+	pthread_mutex_lock(&d->lock);
+	while (d->read >= d->written + DUMP_RING_BLOCKS)
+		pthread_cond_wait(&d->cond, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void dump_advance(struct dump_pipeline *d, u32 *counter) {
+	pthread_mutex_lock(&d->lock);
+	(*counter)++;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Block until stage `next` has something to take from stage `prev` */
+static void dump_wait_for(struct dump_pipeline *d, u32 *next, u32 *prev) {
+	pthread_mutex_lock(&d->lock);
+	while (*next >= *prev)
+		pthread_cond_wait(&d->cond, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void *dump_verifier(void *arg) {
+	struct dump_pipeline *d = arg;
+	u32 nblocks = (d->end_block - d->first_block) * d->nchips;
+	struct dump_slot *slot;
+	int pageno;
+
+	while (d->verified < nblocks) {
+		dump_wait_for(d, &d->verified, &d->read);
+		slot = &d->ring[d->verified % DUMP_RING_BLOCKS];
+		for (pageno = 0; pageno < pages_per_block && !slot->resumed; pageno++) {
+			u8 *buf = slot->buf + pageno * pagebuf_size;
+			if (slot->lens[pageno] < page_size + spare_size)
+				slot->ecc[pageno] = ECC_INVALID;
+			else if ((slot->ecc[pageno] = check_ecc(buf)) == ECC_WRONG &&
+			         correct_page_ecc(buf) >= 0)
+				slot->ecc[pageno] = ECC_CORRECTED;
+		}
+		dump_advance(d, &d->verified);
+	}
+	return NULL;
+}
+
+static void dump_write_block(struct dump_pipeline *d, struct dump_slot *slot) {
+	struct dump_counts *n = &d->counts[slot->chip];
+	struct image *img = d->img[slot->chip];
+	u32 blockno = slot->blockno, suspects = d->suspect[slot->chip].n;
+	int pageno, p, ret;
+
+	printf("\r                                                                     ");
+	printf("\r%04x", blockno);
+	if (d->nchips > 1) printf(" %d:", slot->chip);
+	fflush(stdout);
+	if (slot->resumed) n->resumed++;
+	for(pageno = 0; pageno < pages_per_block && !slot->resumed; pageno++) {
 		p = blockno*pages_per_block + pageno;
-		ret = infectus_readflashpage(buf, p);
-		if (ret==(page_size + spare_size)) {
-/*			if (check_ecc(buf)==ECC_WRONG) {
-				printf("warning, invalid ECC for page %d\n", pageno);
-			} */
-			file_writeflashpage(fp, buf, p);
+		ret = slot->lens[pageno];
+		if (ret >= page_size + spare_size) {
+			switch (slot->ecc[pageno]) {
+				case ECC_OK: n->ok++; break;
+				case ECC_BLANK: n->blank++; break;
+				case ECC_INVALID: n->invalid++; break;
+				case ECC_CORRECTED:
+					n->corrected++;
+					page_list_add(&d->corrected[slot->chip], p);
+					break;
+				case ECC_WRONG:
+					n->wrong++;
+					if (!slot->bad) page_list_add(&d->suspect[slot->chip], p);
+					printf("warning, invalid ECC for page %d\n", p);
+					break;
+			}
+			file_writeflashpage(img, slot->buf + pageno * pagebuf_size, p);
 			putchar('.');
-			fflush(stdout);
 		} else {
+			n->short_reads++;
+			if (!slot->bad) page_list_add(&d->suspect[slot->chip], p | SUSPECT_SHORT);
 			printf("error, short read: %d < %d\n", ret, page_size + spare_size);
 		}
 	}
+	/* a block with pages to read again is recorded when the dump is done */
+	if (d->journal[slot->chip] && !slot->resumed && d->suspect[slot->chip].n == suspects) {
+		if (image_sync(img, blockno) < 0 || journal_add(d->journal[slot->chip], blockno) < 0) {
+			printf("\nCouldn't keep the journal; stopping\n");
+			exit(1);
+		}
+	}
+	image_release(img, blockno*pages_per_block, pages_per_block);
 	float rate = (float)blocks_done / (time(NULL) - start_time);
 	int secs_remaining = (num_blocks - blockno) / rate;
 	if (blocks_done > 2) {
@@ -548,35 +1700,404 @@ int flash_dump_block(FILE *fp, unsigned int blockno) {
 		}
 	} else putchar('\r');
 	fflush(stdout);
-	blocks_done++;
+	if (slot->chip == d->nchips - 1 && !slot->resumed) blocks_done++;
+}
+
+static void *dump_writer(void *arg) {
+	struct dump_pipeline *d = arg;
+	u32 nblocks = (d->end_block - d->first_block) * d->nchips;
+
+	while (d->written < nblocks) {
+		dump_wait_for(d, &d->written, &d->verified);
+		dump_write_block(d, &d->ring[d->written % DUMP_RING_BLOCKS]);
+		dump_advance(d, &d->written);
+	}
+	return NULL;
+}
+
+/* Give every page the pass couldn't read cleanly up to reread_tries more
+   reads, drawing on one budget for the whole dump so a dying chip can't
+   keep us here forever.  Every full read is kept, and after each one
+   merge_page() tries to build a good page from all of them: a read with
+   good ECC, good sectors from different reads, or from the third copy on
+   a bitwise vote that the ECC agrees with.  Returns the number of pages
+   still bad. */
+static u32 dump_reread(struct dump_pipeline *d) {
+	u8 *bufs = malloc((MERGE_MAX + 1) * pagebuf_size), *buf = bufs + MERGE_MAX * pagebuf_size;
+	u8 *copies[MERGE_MAX];
+	u32 budget = DUMP_REREAD_BUDGET, i, p, lost = 0;
+	struct dump_counts *n;
+	int c, t, len, st, ncopies, method;
+
+	for (c = 0; c < d->nchips; c++) {
+		n = &d->counts[c];
+		if (d->suspect[c].n && reread_tries)
+			printf("Re-reading %u pages%s\n", d->suspect[c].n,
+				d->nchips > 1 ? (c ? " on chip 1" : " on chip 0") : "");
+		for (i = 0; i < d->suspect[c].n && (budget || !reread_tries); i++) {
+			p = d->suspect[c].pages[i];
+			st = -1;
+			method = MERGE_SAME;
+			ncopies = 0;
+			/* what the pass read (and has written out) is the first copy */
+			if (!(p & SUSPECT_SHORT)) copies[ncopies++] = image_page(d->img[c], p);
+			for (t = 0; t < reread_tries && budget; t++) {
+				u8 *copy = bufs + (ncopies < MERGE_MAX ? ncopies : MERGE_MAX - 1) * pagebuf_size;
+				if (d->nchips > 1) select_chip(c);
+				budget--;
+				len = infectus_readflashpage(copy, p & ~SUSPECT_SHORT);
+				if (len < page_size + spare_size) continue;
+				if (ncopies < MERGE_MAX) copies[ncopies++] = copy;
+				method = merge_page(copies, ncopies, buf, &st);
+				/* two copies can't outvote each other */
+				if (method == MERGE_VOTE && ncopies < 3) st = ECC_WRONG;
+				if (st != ECC_WRONG) break;
+			}
+			if (st < 0 || st == ECC_WRONG) {
+				page_list_add(&d->lost[c], p & ~SUSPECT_SHORT);
+				continue;
+			}
+			/* good at last: move it out of the WRONG / short count */
+			if (p & SUSPECT_SHORT) n->short_reads--;
+			else n->wrong--;
+			p &= ~SUSPECT_SHORT;
+			file_writeflashpage(d->img[c], buf, p);
+			if (method == MERGE_SECTORS || method == MERGE_VOTE) {
+				printf("page %x: rebuilt from %d reads by %s\n", p, ncopies,
+					method == MERGE_VOTE ? "vote" : "sector");
+				n->merged++;
+				page_list_add(&d->merged[c], p);
+				continue;
+			}
+			printf("page %x: good on re-read %d\n", p, t + 1);
+			switch (st) {
+				case ECC_OK: n->ok++; break;
+				case ECC_BLANK: n->blank++; break;
+				case ECC_INVALID: n->invalid++; break;
+				case ECC_CORRECTED:
+					n->corrected++;
+					page_list_add(&d->corrected[c], p);
+					break;
+			}
+		}
+		if (i < d->suspect[c].n) {
+			printf("Re-read budget used up; %u pages not re-read\n", d->suspect[c].n - i);
+			for (; i < d->suspect[c].n; i++)
+				page_list_add(&d->untried[c], d->suspect[c].pages[i] & ~SUSPECT_SHORT);
+		}
+		lost += d->lost[c].n + d->untried[c].n;
+	}
+	free(bufs);
+	return lost;
+}
+
+static void dump_summary(struct dump_counts *n) {
+	printf("ECC: %u pages OK, %u pages WRONG, %u pages blank, %u pages unreadable",
+		n->ok, n->wrong, n->blank, n->invalid);
+	if (n->corrected) printf(", %u corrected", n->corrected);
+	if (n->merged) printf(", %u rebuilt from several reads", n->merged);
+	if (n->short_reads) printf(", %u short reads", n->short_reads);
+	printf("\n");
+	if (n->resumed) printf("%u blocks were dumped by an earlier run and not read again\n", n->resumed);
+}
+
+/* Dump blocks [first_block, end_block) into imgs[0], or with nchips == 2
+   from each chip into imgs[chip], keeping journals[chip] if not NULL */
+int flash_dump(struct image **imgs, struct journal **journals, int nchips, u32 first_block, u32 end_block) {
+	struct dump_pipeline d;
+	struct dump_slot *slot;
+	pthread_t verifier, writer;
+	u32 blockno;
+	int i, c, prev;
+
+	memset(&d, 0, sizeof d);
+	for (c = 0; c < nchips; c++) {
+		d.img[c] = imgs[c];
+		d.journal[c] = journals[c];
+	}
+	d.nchips = nchips;
+	d.first_block = first_block;
+	d.end_block = end_block;
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_cond_init(&d.cond, NULL);
+	for (i = 0; i < DUMP_RING_BLOCKS; i++) {
+		d.ring[i].buf = malloc(pages_per_block * pagebuf_size);
+		d.ring[i].lens = malloc(pages_per_block * sizeof *d.ring[i].lens);
+		d.ring[i].ecc = malloc(pages_per_block);
+	}
+
+	pthread_create(&verifier, NULL, dump_verifier, &d);
+	pthread_create(&writer, NULL, dump_writer, &d);
+
+	prev = profile_enter(PHASE_READ);
+	for (blockno = first_block; blockno < end_block; blockno++) {
+		for (c = 0; c < nchips; c++) {
+			dump_wait_slot(&d);
+			slot = &d.ring[d.read % DUMP_RING_BLOCKS];
+			slot->blockno = blockno;
+			slot->chip = c;
+			slot->bad = block_is_bad(c, blockno);
+			slot->resumed = journal_done(d.journal[c], blockno);
+			if (slot->resumed) {
+				dump_advance(&d, &d.read);
+				continue;
+			}
+			if (slot->bad && bad_block_policy == BBT_SKIP) {
+				/* not read: an erased block in the image */
+				memset(slot->buf, 0xff, pages_per_block * pagebuf_size);
+				for (i = 0; i < pages_per_block; i++) slot->lens[i] = page_size + spare_size;
+				dump_advance(&d, &d.read);
+				continue;
+			}
+			if (nchips > 1) select_chip(c);
+			infectus_readflashpages(slot->buf, blockno*pages_per_block, pages_per_block, slot->lens);
+			dump_advance(&d, &d.read);
+		}
+	}
+
+	pthread_join(verifier, NULL);
+	pthread_join(writer, NULL);
+
+	printf("\n");
+	dump_reread(&d);
+	profile_leave(prev);
+	for (c = 0; c < nchips; c++) {
+		if (nchips > 1) printf("Chip %d ", c);
+		dump_summary(&d.counts[c]);
+		page_list_print("Corrected pages", &d.corrected[c]);
+		page_list_print("Pages rebuilt from several reads", &d.merged[c]);
+		page_list_print("Unrecoverable pages", &d.lost[c]);
+		page_list_print("Bad pages not re-read (budget used up)", &d.untried[c]);
+		free(d.corrected[c].pages);
+		free(d.suspect[c].pages);
+		free(d.lost[c].pages);
+		free(d.untried[c].pages);
+		free(d.merged[c].pages);
+	}
+
+	for (i = 0; i < DUMP_RING_BLOCKS; i++) {
+		free(d.ring[i].buf);
+		free(d.ring[i].lens);
+		free(d.ring[i].ecc);
+	}
+	pthread_mutex_destroy(&d.lock);
+	pthread_cond_destroy(&d.cond);
 	return 0;
 }
 
 void usage(void) {
 	fprintf(stderr, "Usage: %s command -[tvwdf] [-b blocksize] filename\n", progname);
 	fprintf(stderr, "          -t            test mode -- do not erase or write\n");
+	fprintf(stderr, "          -A            (--all) erase every block, even ones that look\n");
+	fprintf(stderr, "                        blank\n");
 	fprintf(stderr, "          -v            verify every byte of written data\n");
 	fprintf(stderr, "          -w            wait for status after programming\n");
-	fprintf(stderr, "          -x {0,1}      on a dual NAND programmer, choose chip\n");
+	fprintf(stderr, "          -q            quick compare when programming: read only the\n");
+	fprintf(stderr, "                        spare area (ECC) of pages that have ECC.  Data\n");
+	fprintf(stderr, "                        that rotted under intact ECC is not noticed\n");
+	fprintf(stderr, "          -x {0,1,both} on a dual NAND programmer, choose chip.  With both,\n");
+	fprintf(stderr, "                        dump and program take a file per chip (dump\n");
+	fprintf(stderr, "                        names them file-chip0, file-chip1 if only one\n");
+	fprintf(stderr, "                        is given; program writes one file to both)\n");
 	fprintf(stderr, "          -f            force: ignore safety checks. Dangerous!\n");
 	fprintf(stderr, "          -d            debug (enable debugging output)\n");
-	fprintf(stderr, "          -b blocksize  set blocksize; see docs for more info.  Default: 0x%x\n", subpage_size);
+	fprintf(stderr, "          -b blocksize  set blocksize; see docs for more info.  Default: 0x%x,\n", subpage_size);
+	fprintf(stderr, "                        or what tune found for this programmer\n");
+	fprintf(stderr, "          -C mode       (--cache) NAND cache read / cache program for dump\n");
+	fprintf(stderr, "                        and program: auto (where the chip has them),\n");
+	fprintf(stderr, "                        on or off.  Default: auto\n");
+	fprintf(stderr, "          -M mode       (--multi-plane) erase and program pairs of\n");
+	fprintf(stderr, "                        blocks in both planes at once: auto (where the\n");
+	fprintf(stderr, "                        chip has two planes) or off.  Default: auto.\n");
+	fprintf(stderr, "                        program does this with one chip only\n");
+	fprintf(stderr, "          -g id         (--chip) take the geometry of the chip with this\n");
+	fprintf(stderr, "                        ID (e.g. ecd5) from the chip table: for files\n");
+	fprintf(stderr, "                        from such a chip, or in place of detection\n");
+	fprintf(stderr, "          -c            coalesce each page operation into one USB transfer\n");
+	fprintf(stderr, "                        (only if the firmware accepts it)\n");
+	fprintf(stderr, "          -p depth      keep up to depth USB commands in flight when\n");
+	fprintf(stderr, "                        reading (1-%d).  Default: %d\n", QUEUE_DEPTH_MAX, queue_depth);
+	fprintf(stderr, "          -j jobs       use this many threads for check, sums and strip\n");
+	fprintf(stderr, "                        (0 = one per CPU).  Default: %d\n", jobs);
+	fprintf(stderr, "          -m            keep a manifest (file.amx) of block and page\n");
+	fprintf(stderr, "                        hashes next to the image.  check, sums and\n");
+	fprintf(stderr, "                        program --base use an up to date one if present\n");
+	fprintf(stderr, "          -R            (--resume) carry on an interrupted dump or\n");
+	fprintf(stderr, "                        program from its journal (file.journal), skipping\n");
+	fprintf(stderr, "                        the blocks it had finished\n");
+	fprintf(stderr, "          -P            (--profile) time every USB command and print\n");
+	fprintf(stderr, "                        round trip percentiles per command, and the time\n");
+	fprintf(stderr, "                        spent reading, comparing, erasing, programming,\n");
+	fprintf(stderr, "                        verifying and waiting for status, at exit\n");
+	fprintf(stderr, "          -r tries      when dumping, read pages with uncorrectable ECC\n");
+	fprintf(stderr, "                        errors up to this many more times, piecing\n");
+	fprintf(stderr, "                        the reads together or voting between them\n");
+	fprintf(stderr, "                        as merge does.  Default: %d\n", reread_tries);
+	fprintf(stderr, "          -k policy     (--bad-blocks) what to do with blocks marked bad:\n");
+	fprintf(stderr, "                        read (default): program and erase leave them\n");
+	fprintf(stderr, "                        alone, dump reads them; skip: dump writes them\n");
+	fprintf(stderr, "                        as erased without reading; ignore: no bad\n");
+	fprintf(stderr, "                        block scan, every block is treated alike\n");
 	fprintf(stderr, "          -s blockno    start block -- skip this number of blocks\n");
 	fprintf(stderr, "                        before proceeding\n");
+	fprintf(stderr, "          -u device     use this programmer: bus:address, serial number\n");
+	fprintf(stderr, "                        or all.  Give -u more than once (or all) to run\n");
+	fprintf(stderr, "                        program, dump or erase on several at once\n");
+	fprintf(stderr, "          -F format     (--format) image format for dump and convert:\n");
+	fprintf(stderr, "                        raw, sparse (only pages that aren't all FF,\n");
+	fprintf(stderr, "                        with an index), or zlib (sparse, with each\n");
+	fprintf(stderr, "                        block compressed).  Every command reads all\n");
+	fprintf(stderr, "                        three.  Default: raw\n");
+	fprintf(stderr, "          -D socket     (--server) send the command to the server on\n");
+	fprintf(stderr, "                        socket instead of opening the programmer (see\n");
+	fprintf(stderr, "                        serve).  For serve, where to listen.  Default:\n");
+	fprintf(stderr, "                        ~/.amoxiflash-socket\n");
+	fprintf(stderr, "          -S spec       use a simulated Infectus instead of USB; spec is\n");
+	fprintf(stderr, "                        mem or file=name, plus optional latency=usec,\n");
+	fprintf(stderr, "                        id=hex, blocks=n, tr=, tprog=, tbers=usec;\n");
+	fprintf(stderr, "                        page=, spare=, ppb= for other geometries,\n");
+	fprintf(stderr, "                        onfi=1 to answer the ONFI parameter page;\n");
+	fprintf(stderr, "                        chips=2 (and file1=name) for a dual programmer;\n");
+	fprintf(stderr, "                        bad=n:n:... (bad1=) marks blocks factory bad\n");
 	fprintf(stderr, "\nValid commands are:\n");
 	fprintf(stderr, "         check        check ECC data in file\n");
 	fprintf(stderr, "         strip        strip ECC data from file\n");
 	fprintf(stderr, "         sums         calculate simple checksum for each page of a file\n");
 	fprintf(stderr, "         dump         read from flash chip and dump to file\n");
+	fprintf(stderr, "         convert in out\n");
+	fprintf(stderr, "                      copy an image into the format given by -F\n");
+	fprintf(stderr, "         merge out in1 in2 [...]\n");
+	fprintf(stderr, "                      build the best image from several dumps of one\n");
+	fprintf(stderr, "                        chip: per page, a copy with good ECC, else good\n");
+	fprintf(stderr, "                        sectors from different copies, else a bitwise\n");
+	fprintf(stderr, "                        majority vote\n");
 	fprintf(stderr, "         program      compare file to flash contents, reprogram flash\n");
 	fprintf(stderr, "                        to match file\n");
-	fprintf(stderr, "         erase        erase the entire flash chip\n");
+	fprintf(stderr, "         program --base old new\n");
+	fprintf(stderr, "                      the chip is known to hold old (e.g. an earlier\n");
+	fprintf(stderr, "                        dump): rewrite just the blocks where new differs,\n");
+	fprintf(stderr, "                        without reading the chip first\n");
+	fprintf(stderr, "         erase        erase the entire flash chip.  With -c or -p,\n");
+	fprintf(stderr, "                        blocks whose first page and the spare areas of\n");
+	fprintf(stderr, "                        every 8th page are blank are skipped\n");
+	fprintf(stderr, "         bbt          scan the chip for bad blocks and update the\n");
+	fprintf(stderr, "                        cached table (~/.amoxiflash-bbt)\n");
+	fprintf(stderr, "         tune         find the fastest block size for this programmer\n");
+	fprintf(stderr, "                        (uses the last block, or -s; -t reads only)\n");
+	fprintf(stderr, "         list         list attached programmers\n");
+	fprintf(stderr, "         serve        open the programmer once and run the commands\n");
+	fprintf(stderr, "                        of clients (-D socket) on it, one at a time.\n");
+	fprintf(stderr, "                        Options given to serve apply to every command\n");
 
 	exit(1);	
 }
 
+/* Page jobs: work() runs for every page of an image, spread over `jobs`
+   threads a chunk at a time; emit() then runs for every page in page order
+   on the calling thread, with the usual progress line at the start of each
+   chunk.  Output is therefore the same whatever the thread count.  work
+   may be NULL when the results are already to hand, e.g. from a manifest.
+   Each chunk of the image is released once it has been emitted. */
+#define JOB_CHUNK_PAGES 2048
+
+struct page_job {
+	struct image *img;
+	u32 num_pages;
+	void (*work)(struct page_job *job, u32 pageno);
+	void (*emit)(struct page_job *job, u32 pageno);
+	void *ctx;
+
+	u32 next_chunk;
+	u8 *chunk_done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void page_job_chunk(struct page_job *job, u32 chunk) {
+	u32 pageno = chunk * JOB_CHUNK_PAGES, end = pageno + JOB_CHUNK_PAGES;
+	if (!job->work) return;
+	if (end > job->num_pages) end = job->num_pages;
+	for (; pageno < end; pageno++) job->work(job, pageno);
+}
+
+static void *page_job_worker(void *arg) {
+	struct page_job *job = arg;
+	u32 nchunks = (job->num_pages + JOB_CHUNK_PAGES - 1) / JOB_CHUNK_PAGES;
+	u32 chunk;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		chunk = job->next_chunk++;
+		pthread_mutex_unlock(&job->lock);
+		if (chunk >= nchunks) break;
+
+		page_job_chunk(job, chunk);
+
+		pthread_mutex_lock(&job->lock);
+		job->chunk_done[chunk] = 1;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+void run_page_job(struct page_job *job) {
+	u32 nchunks = (job->num_pages + JOB_CHUNK_PAGES - 1) / JOB_CHUNK_PAGES;
+	u32 chunk, pageno, end;
+	pthread_t *threads = NULL;
+	int nthreads = jobs, i;
+
+	if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > nchunks) nthreads = nchunks;
+	if (!job->work) nthreads = 1;	/* emit only: the answers are already in */
+
+	if (nthreads > 1) {
+		job->next_chunk = 0;
+		job->chunk_done = calloc(nchunks, 1);
+		pthread_mutex_init(&job->lock, NULL);
+		pthread_cond_init(&job->cond, NULL);
+		threads = malloc(nthreads * sizeof *threads);
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&threads[i], NULL, page_job_worker, job);
+	}
+
+	for (chunk = 0; chunk < nchunks; chunk++) {
+		pageno = chunk * JOB_CHUNK_PAGES;
+		printf ("\r%04.1f%%  ", pageno * 100.0 / job->num_pages);
+		draw_spin();
+
+		if (threads) {
+			pthread_mutex_lock(&job->lock);
+			while (!job->chunk_done[chunk])
+				pthread_cond_wait(&job->cond, &job->lock);
+			pthread_mutex_unlock(&job->lock);
+		} else {
+			page_job_chunk(job, chunk);
+		}
+
+		end = pageno + JOB_CHUNK_PAGES;
+		if (end > job->num_pages) end = job->num_pages;
+		if (job->emit)
+			for (; pageno < end; pageno++) job->emit(job, pageno);
+		image_release(job->img, chunk * JOB_CHUNK_PAGES, end - chunk * JOB_CHUNK_PAGES);
+	}
+
+	if (threads) {
+		for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+		free(threads);
+		free(job->chunk_done);
+		pthread_mutex_destroy(&job->lock);
+		pthread_cond_destroy(&job->cond);
+	}
+}
+
+static void strip_work(struct page_job *job, u32 pageno) {
+	u8 *out = job->ctx;
+	memcpy(out + (u64)pageno * page_size, file_readflashpage(job->img, pageno), page_size);
+}
+
 int strip_file_ecc(char *filename) {
-	u32 pageno;
 	if (!filename) {
 		fprintf(stderr, "Error: you must specify a filename to strip\n");
 		usage();
@@ -585,14 +2106,12 @@ int strip_file_ecc(char *filename) {
 	char *output_filename=malloc(strlen(filename)+5);
 	sprintf(output_filename, "%s.raw", filename);
 	
-	FILE *fp = fopen(filename, "rb");
-	if(!fp) {
+	struct image *img = image_open(filename);
+	if(!img) {
 		perror("Couldn't open input file: ");
 		exit(1);
 	}
-	fseek(fp, 0, SEEK_END);
-	off_t file_length = ftello(fp);
-	fseek(fp, 0, SEEK_SET);
+	u64 file_length = img->size;
 	
 	if ((file_length % (page_size + spare_size)) && !force) {
 		printf("Error: File length is not a multiple of %d bytes.  Are you sure\n",
@@ -602,33 +2121,100 @@ int strip_file_ecc(char *filename) {
 	}
 
 	printf("Stripping ECC data from %s into %s\n", filename, output_filename);
-	FILE *fp_out = fopen(output_filename, "wb");
-	if(!fp_out) {
+	u64 num_pages = img->num_pages;
+	struct image *out = image_create(output_filename, num_pages * page_size);
+	if(!out) {
 		perror("Couldn't open output file: ");
 		exit(1);
 	}
 	
-	u64 num_pages = file_length / (page_size + spare_size);
 	printf("File size: %"PRIu64" bytes / %"PRIu64" pages / %"PRIu64" blocks\n", 
 		file_length, num_pages, num_pages / pages_per_block);
 	
-	for (pageno=0; (pageno < num_pages) && !feof(fp); pageno++) {
-		u8 buf[PAGEBUF_SIZE];
-		if ((pageno % 2048)==0) {
-			printf ("\r%04.1f%%  ", pageno * 100.0 / num_pages);
-			draw_spin();
+	struct page_job job = { img, num_pages, strip_work, NULL, out->map };
+	run_page_job(&job);
+	image_close(out);
+	image_close(img);
+	return 0;
+}
+
+/* Copy an image into the format of -F, e.g. a raw dump into a sparse or
+   compressed one, or back */
+int convert_image(char *in_filename, char *out_filename) {
+	struct image *in, *out;
+	struct stat st_in, st_out;
+	u64 pageno;
+
+	if (!(in = image_open(in_filename))) {
+		perror("Couldn't open input file: ");
+		exit(1);
+	}
+	if (image_format != IMAGE_RAW)
+		out = image_create_sparse(out_filename, in->num_pages, image_format);
+	else
+		out = image_create(out_filename, in->num_pages * (page_size + spare_size));
+	if (!out) {
+		perror("Couldn't open output file: ");
+		exit(1);
+	}
+	printf("Converting %s (%s) into %s (%s), %"PRIu64" pages\n",
+		in_filename, image_format_names[in->format],
+		out_filename, image_format_names[image_format], in->num_pages);
+	for (pageno = 0; pageno < in->num_pages; pageno++) {
+		if (image_write_page(out, pageno, image_page(in, pageno)) < 0) {
+			image_close(out);
+			exit(1);
+		}
+		if ((pageno + 1) % pages_per_block == 0) {
+			image_release(in, pageno + 1 - pages_per_block, pages_per_block);
+			image_release(out, pageno + 1 - pages_per_block, pages_per_block);
 		}
-		fread(buf, 1, page_size + spare_size, fp);
-		fwrite(buf, 1, page_size, fp_out);
 	}
-	fclose(fp_out);
-	fclose(fp);
+	image_close(out);
+	image_close(in);
+	if (stat(in_filename, &st_in) == 0 && stat(out_filename, &st_out) == 0)
+		printf("%"PRIu64" bytes -> %"PRIu64" bytes\n", (u64)st_in.st_size, (u64)st_out.st_size);
 	return 0;
 }
 
+struct check_results {
+	u8 *status;
+	u32 count_invalid, count_wrong, count_blank, count_ok;
+};
+
+static void check_work(struct page_job *job, u32 pageno) {
+	struct check_results *r = job->ctx;
+	r->status[pageno] = check_ecc(file_readflashpage(job->img, pageno));
+}
+
+static void check_emit(struct page_job *job, u32 pageno) {
+	struct check_results *r = job->ctx;
+	u8 *buf, ecc[4 * ECC_SECTORS_MAX];
+
+	switch (r->status[pageno]) {
+		case ECC_OK: 
+			r->count_ok++;
+		break;
+		case ECC_WRONG:
+			r->count_wrong++;
+			buf = file_readflashpage(job->img, pageno);
+		 	printf("%d: ecc WRONG\n", pageno);
+			printf("Stored ECC: "); hexdump(buf + ECC_OFFSET, 4 * ECC_SECTORS);
+			calc_page_ecc(buf, ecc);
+			printf("Calc   ECC: "); hexdump(ecc, 4 * ECC_SECTORS);
+			break;
+		case ECC_INVALID: 
+			r->count_invalid++;
+		break;
+		case ECC_BLANK: 
+			r->count_blank++;
+		break;
+		default: break;
+	}
+}
+
 int check_file_ecc(char *filename) {
-	u32 pageno;
-	u32 count_invalid=0, count_wrong=0, count_blank=0, count_ok=0;
+	struct check_results r;
 	
 	if (!filename) {
 		fprintf(stderr, "Error: you must specify a filename to check\n");
@@ -636,46 +2222,28 @@ int check_file_ecc(char *filename) {
 	}
 	printf("Checking ECC for file %s\n", filename);
 	start_time = time(NULL);
-	FILE *fp = fopen(filename, "rb");
-	if(!fp) {
+	struct image *img = image_open(filename);
+	if(!img) {
 		perror("Couldn't open file: ");
 		exit(1);
 	}
-	fseek(fp, 0, SEEK_END);
-	off_t file_length = ftello(fp);
-	fseek(fp, 0, SEEK_SET);
-	u64 num_pages = file_length / (page_size + spare_size);
+	u64 file_length = img->size;
+	u64 num_pages = img->num_pages;
 	printf("File size: %"PRIu64" bytes / %"PRIu64" pages / %"PRIu64" blocks\n", 
 		file_length, num_pages, num_pages / pages_per_block);
-	for (pageno = 0; pageno < num_pages && !feof(fp); pageno++) {
-		u8 buf[PAGEBUF_SIZE];
-		file_readflashpage(fp, buf, pageno);
-		if ((pageno % 2048)==0) {
-			printf ("\r%04.1f%%  ", pageno * 100.0 / num_pages);
-			draw_spin();
-		}
-		switch (check_ecc(buf)) {
-			case ECC_OK: 
-				count_ok++;
-			break;
-			case ECC_WRONG:
-				count_wrong++;
-			 	printf("%d: ecc WRONG\n", pageno);
-				printf("Stored ECC: "); hexdump(buf+page_size+48, 16);
-				printf("Calc   ECC: "); hexdump(calc_page_ecc(buf), 16);
-				break;
-			case ECC_INVALID: 
-				count_invalid++;
-			break;
-			case ECC_BLANK: 
-				count_blank++;
-			break;
-			default: break;
-		}
-	}
-	fclose(fp);
+	memset(&r, 0, sizeof r);
+	struct manifest *m = get_manifest(filename);
+	struct page_job job = { img, num_pages, check_work, check_emit, &r };
+	if (m) {
+		r.status = m->ecc;
+		job.work = NULL;
+	} else r.status = malloc(num_pages);
+	run_page_job(&job);
+	if (m) manifest_close(m);
+	else free(r.status);
+	image_close(img);
 	printf("\nTotals: %u pages OK, %u pages WRONG, %u pages blank, %u pages unreadable\n",
-		count_ok, count_wrong, count_blank, count_invalid);
+		r.count_ok, r.count_wrong, r.count_blank, r.count_invalid);
 	exit(0);
 	return 1;
 }
@@ -704,8 +2272,27 @@ void compute_bits_in_char (void)
     return ;
 }
 
+struct sums_results {
+	u32 *sums;
+	FILE *out_fp;
+};
+
+static void sums_work(struct page_job *job, u32 pageno) {
+	struct sums_results *r = job->ctx;
+	u8 *buf = file_readflashpage(job->img, pageno);
+	unsigned int sum = 0;
+	int i;
+	for (i=0; i<page_size; i++) sum += bits_in_char[buf[i]];
+	r->sums[pageno] = sum;
+}
+
+static void sums_emit(struct page_job *job, u32 pageno) {
+	struct sums_results *r = job->ctx;
+	fprintf(r->out_fp, "%x %x\n", pageno, r->sums[pageno]);
+}
+
 int generate_checksums(char *filename) {
-	u32 pageno;
+	struct sums_results r;
 	char output_filename[1024];
 	compute_bits_in_char();
 	
@@ -716,55 +2303,233 @@ int generate_checksums(char *filename) {
 	sprintf(output_filename, "%s.out", filename);
 	printf("Generating sums for file %s, outputting to %s\n", filename, output_filename);
 	start_time = time(NULL);
-	FILE *fp = fopen(filename, "rb");
-	if(!fp) {
+	struct image *img = image_open(filename);
+	if(!img) {
 		perror("Couldn't open file: ");
 		exit(1);
 	}
-	fseek(fp, 0, SEEK_END);
-	off_t file_length = ftello(fp);
-	fseek(fp, 0, SEEK_SET);
-	u64 num_pages = file_length / (page_size + spare_size);
+	u64 file_length = img->size;
+	u64 num_pages = img->num_pages;
 	printf("File size: %"PRIu64" bytes / %"PRIu64" pages / %"PRIu64" blocks\n", 
 		file_length, num_pages, num_pages / pages_per_block);
 		
 	FILE *out_fp = fopen(output_filename, "w");
-	if(!fp) {
+	if(!out_fp) {
 		perror("Couldn't open output file: ");
 		exit(1);
 	}	
-	for (pageno = 0; pageno < num_pages && !feof(fp); pageno++) {
-		u8 buf[PAGEBUF_SIZE];
-		int i;
-		unsigned int sum=0;
-		file_readflashpage(fp, buf, pageno);
-		for (i=0; i<page_size; i++) sum += bits_in_char[buf[i]];
-		fprintf(out_fp, "%x %x\n", pageno, sum);
-		if ((pageno % 2048)==0) {
-			printf ("\r%04.1f%%  ", pageno * 100.0 / num_pages);
-			draw_spin();
-		}
-		
-	}
-	fclose(fp);
+	struct manifest *m = get_manifest(filename);
+	struct page_job job = { img, num_pages, sums_work, sums_emit, &r };
+	if (m) {
+		r.sums = m->sums;
+		job.work = NULL;
+	} else r.sums = malloc(num_pages * sizeof *r.sums);
+	r.out_fp = out_fp;
+	run_page_job(&job);
+	if (m) manifest_close(m);
+	else free(r.sums);
+	image_close(img);
 	fclose(out_fp);
 	exit(0);
 	return 1;
 }
 
+/* -m: index an image into its manifest.  Chunks are a multiple of 8 pages,
+   so no two threads ever share a byte of the blank bitmap. */
+static void index_work(struct page_job *job, u32 pageno) {
+	struct manifest *m = job->ctx;
+	u8 *buf = file_readflashpage(job->img, pageno);
+	unsigned int sum = 0;
+	int i;
 
-void usb_exit_handler(void) {
-	usb_close(h);
+	m->page_hash[pageno] = page_hash(buf, page_size + spare_size);
+	m->ecc[pageno] = check_ecc(buf);
+	for (i=0; i<page_size; i++) sum += bits_in_char[buf[i]];
+	m->sums[pageno] = sum;
+	if (flash_isFF(buf, page_size + spare_size)) m->blank[pageno / 8] |= 1 << (pageno % 8);
 }
 
-int check_file_validity(FILE *fp) {
-	u64 original_offset;
-	u64 file_size;
-	u8 header_magic[4];
-	
-	original_offset = ftello(fp);
-	fseeko(fp, 0, SEEK_END);
-	file_size = ftello(fp);
+struct manifest *build_manifest(const char *filename) {
+	struct image *img;
+	struct manifest *m;
+	char *name = manifest_filename(filename);
+
+	compute_bits_in_char();
+	if (!(img = image_open(filename))) {
+		perror("Couldn't open file: ");
+		exit(1);
+	}
+	if (!(m = manifest_create(filename, img->num_pages))) {
+		perror("Couldn't create manifest: ");
+		image_close(img);
+		free(name);
+		return NULL;
+	}
+	printf("Indexing %s into %s\n", filename, name);
+	struct page_job job = { img, img->num_pages, index_work, NULL, m };
+	run_page_job(&job);
+	printf("\r");
+	image_close(img);
+	if (manifest_finish(m, filename) < 0) perror("Couldn't finish manifest: ");
+	free(name);
+	return m;
+}
+
+/* The manifest for filename if there is an up to date one, or with -m a
+   freshly built one */
+struct manifest *get_manifest(const char *filename) {
+	struct manifest *m = manifest_open(filename);
+	if (m) {
+		if (debug_mode) printf("Using manifest for %s\n", filename);
+		return m;
+	}
+	return make_manifest ? build_manifest(filename) : NULL;
+}
+
+/* program --base: find the blocks where new differs from base (what the
+   chip is known to hold) by comparing the two files, without the chip */
+struct base_diff {
+	struct image *base;
+	u8 *page_dirty;
+	u8 *block_dirty;
+};
+
+static void diff_work(struct page_job *job, u32 pageno) {
+	struct base_diff *d = job->ctx;
+	u8 *old = image_page(d->base, pageno);
+	d->page_dirty[pageno] = !old ||
+		memcmp(old, image_page(job->img, pageno), page_size + spare_size);
+}
+
+static void diff_emit(struct page_job *job, u32 pageno) {
+	struct base_diff *d = job->ctx;
+	if (d->page_dirty[pageno]) d->block_dirty[pageno / pages_per_block] = 1;
+	if ((pageno + 1) % pages_per_block == 0)
+		image_release(d->base, pageno + 1 - pages_per_block, pages_per_block);
+}
+
+/* Returns one flag per block of img, set where it differs from base */
+u8 *diff_images(struct image *base, struct image *img, u32 nblocks) {
+	struct base_diff d;
+	struct page_job job = { img, nblocks * pages_per_block, diff_work, diff_emit, &d };
+
+	d.base = base;
+	d.page_dirty = malloc(job.num_pages);
+	d.block_dirty = calloc(nblocks, 1);
+	run_page_job(&job);
+	free(d.page_dirty);
+	printf("\r");
+	return d.block_dirty;
+}
+
+/* merge: rebuild an image from several dumps of the same chip, a page at
+   a time with merge_page() */
+struct merge_results {
+	struct image **in;
+	int n;
+	struct image *out;
+	u8 *method, *ecc;
+	u32 count[MERGE_FAILED + 1];
+	u32 corrected;
+	struct page_list voted, wrong;
+};
+
+static void merge_work(struct page_job *job, u32 pageno) {
+	struct merge_results *r = job->ctx;
+	u8 *copies[MERGE_MAX];
+	int i, ecc;
+
+	for (i = 0; i < r->n; i++) copies[i] = file_readflashpage(r->in[i], pageno);
+	r->method[pageno] = merge_page(copies, r->n, image_page(r->out, pageno), &ecc);
+	/* two copies can't outvote each other: where they differ, a vote
+	   between them only ORs them together */
+	if (r->method[pageno] == MERGE_VOTE && r->n < 3) {
+		r->method[pageno] = MERGE_FAILED;
+		ecc = ECC_WRONG;
+	}
+	r->ecc[pageno] = ecc;
+}
+
+static void merge_emit(struct page_job *job, u32 pageno) {
+	struct merge_results *r = job->ctx;
+	int i;
+
+	r->count[r->method[pageno]]++;
+	if (r->method[pageno] == MERGE_VOTE) page_list_add(&r->voted, pageno);
+	if (r->ecc[pageno] == ECC_CORRECTED) r->corrected++;
+	if (r->ecc[pageno] == ECC_WRONG) page_list_add(&r->wrong, pageno);
+	if ((pageno + 1) % pages_per_block == 0)
+		for (i = 1; i < r->n; i++)
+			image_release(r->in[i], pageno + 1 - pages_per_block, pages_per_block);
+}
+
+int merge_images(char *out_filename, int n, char **filenames) {
+	struct merge_results r;
+	u64 num_pages = 0;
+	int i;
+
+	if (n < 2 || n > MERGE_MAX) {
+		fprintf(stderr, "Error: merge takes an output file and 2 to %d input files\n", MERGE_MAX);
+		usage();
+	}
+	memset(&r, 0, sizeof r);
+	r.n = n;
+	r.in = malloc(n * sizeof *r.in);
+	for (i = 0; i < n; i++) {
+		if (!(r.in[i] = image_open(filenames[i]))) {
+			perror(filenames[i]);
+			exit(1);
+		}
+		if (i && r.in[i]->num_pages != num_pages)
+			printf("WARNING: %s is not the same size as %s\n", filenames[i], filenames[0]);
+		if (!i || r.in[i]->num_pages < num_pages) num_pages = r.in[i]->num_pages;
+	}
+	printf("Merging %d images of %"PRIu64" pages into %s\n", n, num_pages, out_filename);
+	if (!(r.out = image_create(out_filename, num_pages * (page_size + spare_size)))) {
+		perror("Couldn't open output file: ");
+		exit(1);
+	}
+	r.method = malloc(num_pages);
+	r.ecc = malloc(num_pages);
+	if (!jobs_set) jobs = 0;
+	struct page_job job = { r.in[0], num_pages, merge_work, merge_emit, &r };
+	run_page_job(&job);
+	image_close(r.out);
+	for (i = 0; i < n; i++) image_close(r.in[i]);
+
+	printf("\r%u pages the same in every image, %u taken from an image with good ECC,\n",
+		r.count[MERGE_SAME], r.count[MERGE_ECC]);
+	printf("%u pieced together from good sectors, %u decided by vote, %u votes failed\n",
+		r.count[MERGE_SECTORS], r.count[MERGE_VOTE], r.count[MERGE_FAILED]);
+	if (r.corrected) printf("%u pages needed single-bit ECC corrections\n", r.corrected);
+	page_list_print("Pages decided by vote", &r.voted);
+	page_list_print("Pages with bad ECC in the result", &r.wrong);
+	if (make_manifest) manifest_close(build_manifest(out_filename));
+	free(r.voted.pages);
+	free(r.wrong.pages);
+	free(r.method);
+	free(r.ecc);
+	free(r.in);
+	return r.wrong.n ? 1 : 0;
+}
+
+void transport_exit_handler(void) {
+	transport->close();
+}
+
+/* Per-device output name for a gang dump: nand.bin -> nand-001-004.bin */
+char *gang_filename(const char *filename, const char *target) {
+	char *out = malloc(strlen(filename) + strlen(target) + 2), *p;
+	const char *dot = strrchr(filename, '.');
+	if (!dot || strchr(dot, '/')) dot = filename + strlen(filename);
+	sprintf(out, "%.*s-%s%s", (int)(dot - filename), filename, target, dot);
+	for (p = out + (dot - filename) + 1; *p && p < out + (dot - filename) + 1 + strlen(target); p++)
+		if (*p == ':') *p = '-';
+	return out;
+}
+
+int check_file_validity(struct image *img) {
+	u64 file_size = img->size;
 	
 	if (file_size % (page_size + spare_size)) {
 		printf("WARNING:  This file does not seem to be a valid dump file,\n");
@@ -772,38 +2537,186 @@ int check_file_validity(FILE *fp) {
 			file_size, page_size + spare_size);
 	}
 	
-	fseeko(fp, 0, SEEK_SET);
-	fread(header_magic, 1, 4, fp);
-	
-	if (memcmp(header_magic, "\x27\xAE\x8C\x9C", 4)) {
+	if (file_size < 4 || memcmp(image_page(img, 0), "\x27\xAE\x8C\x9C", 4)) {
 		printf("WARNING: This file does not seem to be a Wii firmware dump.\n");
 	}
-	fseeko(fp, original_offset, SEEK_SET);
 	return 0;
 }
 
-int main (int argc,char **argv)
-{
-	int retval;
+/* Long spellings of options.  They are rewritten to the short forms before
+   getopt() runs, as not every getopt has getopt_long(). */
+static const struct {
+	const char *name, *opt;
+} long_option_names[] = {
+	{ "--base", "-B" },
+	{ "--bad-blocks", "-k" },
+	{ "--all", "-A" },
+	{ "--cache", "-C" },
+	{ "--multi-plane", "-M" },
+	{ "--chip", "-g" },
+	{ "--server", "-D" },
+	{ "--format", "-F" },
+	{ "--resume", "-R" },
+	{ "--profile", "-P" },
+};
+
+void long_options(int argc, char **argv) {
+	int i, j, n;
+	char *eq;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) || !argv[i][2]) continue;
+		for (j = 0; j < sizeof long_option_names / sizeof long_option_names[0]; j++) {
+			n = strlen(long_option_names[j].name);
+			if (strncmp(argv[i], long_option_names[j].name, n)) continue;
+			eq = argv[i] + n;
+			if (*eq == 0) {
+				argv[i] = (char *)long_option_names[j].opt;
+			} else if (*eq == '=') {
+				/* --name=value becomes -Xvalue */
+				char *opt = malloc(strlen(eq) + 2);
+				sprintf(opt, "%s%s", long_option_names[j].opt, eq + 1);
+				argv[i] = opt;
+			} else continue;
+			break;
+		}
+	}
+}
+
+/* program: whether blockno starts a pair for flash_program_planes().  With
+   both chips in use the chips already take turns, so pairs are one-chip. */
+static int program_pair(unsigned int blockno) {
+	return multi_plane && num_chips == 1 && blockno % 2 == 0 && blockno + 1 < num_blocks;
+}
+
+/* program: blocks first to last are finished.  Done with them in the
+   images, and they go in the journal. */
+static void program_done(struct image **imgs, struct journal *journal, u32 first, u32 last) {
+	u32 blockno;
+
+	image_release(imgs[0], first * pages_per_block, (last - first + 1) * pages_per_block);
+	if (imgs[1] != imgs[0])
+		image_release(imgs[1], first * pages_per_block, (last - first + 1) * pages_per_block);
+	for (blockno = first; blockno <= last; blockno++) {
+		if (journal_add(journal, blockno) < 0) {
+			printf("\nCouldn't keep the journal; stopping\n");
+			exit(1);
+		}
+	}
+}
+
+/* What a program journal is kept against: the chip and the image files
+   (by size and time), so one can't be resumed with another image */
+static void program_journal_key(char *key, int len, u32 flashid, char *filename, char *filename1) {
+	struct stat st;
+	int n;
+
+	n = snprintf(key, len, "program %04x %d+%d %d %u", flashid, page_size, spare_size,
+		pages_per_block, num_blocks);
+	if (stat(filename, &st) == 0)
+		n += snprintf(key + n, len - n, " %"PRIu64" %ld", (u64)st.st_size, (long)st.st_mtime);
+	if (filename1 && stat(filename1, &st) == 0)
+		snprintf(key + n, len - n, " %"PRIu64" %ld", (u64)st.st_size, (long)st.st_mtime);
+}
+
+/* Take on a chip's geometry.  Page buffers leave room for the last
+   transfer of a page to run past its end. */
+void set_geometry(const struct chip_type *chip) {
+	page_size = chip->page_size;
+	spare_size = chip->spare_size;
+	pages_per_block = chip->pages_per_block;
+	num_blocks = chip->num_blocks;
+	pagebuf_size = (page_size + spare_size + SUBPAGE_MAX + 63) & ~63;
+	if (pagebuf_size > PAGEBUF_MAX || page_size % 512 || ECC_SECTORS > ECC_SECTORS_MAX ||
+	    spare_size < 4 * ECC_SECTORS) {
+		printf("Pages of %d+%d bytes are not supported\n", page_size, spare_size);
+		exit(1);
+	}
+}
+
+/* What the selected chip is, by ONFI, the chip table or the extended ID
+   (see chips.c).  NULL if none of them knows. */
+static const struct chip_type *detect_chip(u32 flashid) {
+	static struct chip_type probed;
+	const struct chip_type *known = find_chip_type(flashid);
+	u8 id[5], sig[4], param[ONFI_PARAM_COPIES * ONFI_PARAM_LEN];
+
+	infectus_readid(id, 0, 5);
+	if (debug_mode) {
+		printf("Full ID: ");
+		hexdump(id, 5);
+	}
+	infectus_readid(sig, 0x20, 4);
+	if (!memcmp(sig, "ONFI", 4)) {
+		if (infectus_readparams(param) == sizeof param &&
+		    chip_from_onfi(&probed, param, sizeof param) == 0) {
+			probed.id = flashid;
+			printf("Geometry from the ONFI parameter page\n");
+			return &probed;
+		}
+		printf("ONFI chip, but its parameter page doesn't read back intact\n");
+	}
+	if (known) return known;
+	if (chip_from_id(&probed, id) == 0) {
+		probed.id = flashid;
+		printf("Unknown flash ID %04x; geometry from the extended ID bytes\n", flashid);
+		return &probed;
+	}
+	return NULL;
+}
+
+static char *sim_specs[GANG_MAX], *device_specs[GANG_MAX];
+static int num_sim_specs = 0, num_device_specs = 0;
+
+/* Options, from argv[optind] on, into the globals */
+static void parse_options(int argc, char **argv) {
 	char ch;
-	char *filename = NULL;
-	
-	progname = argv[0];
-	printf("amoxiflash version %s, (c) 2008,2009 bushing\n", VERSION);
-	
-	if (argc < 2) usage();
-	char *command = argv[1];
-	optind = 2; // skip over command
-	
-	while ((ch = getopt(argc, argv, "b:tvwx:df:s:q")) != -1) {
+
+	while ((ch = getopt(argc, argv, "b:tvwx:df:s:qS:p:cj:u:B:mr:k:AC:M:g:D:F:RP")) != -1) {
 		switch (ch) {
-			case 'b': subpage_size = strtol(optarg, NULL, 0); break;
+			case 'b': subpage_size = strtol(optarg, NULL, 0);
+				subpage_size_set = 1;
+				if (subpage_size < 8 || subpage_size > SUBPAGE_MAX) {
+					fprintf(stderr, "Invalid blocksize -- must be 8 to 0x%x\n", SUBPAGE_MAX);
+					usage();
+				}
+				break;
 			case 't': test_mode = 1; break;
+			case 'g':
+				chip_override = find_chip_type(strtoul(optarg, NULL, 16));
+				if (!chip_override) {
+					fprintf(stderr, "Unknown chip ID %s\n", optarg);
+					usage();
+				}
+				break;
+			case 'A': erase_all = 1; break;
+			case 'C':
+				if (!strcmp(optarg, "auto")) cache_mode = CACHE_AUTO;
+				else if (!strcmp(optarg, "on")) cache_mode = CACHE_ON;
+				else if (!strcmp(optarg, "off")) cache_mode = CACHE_OFF;
+				else {
+					fprintf(stderr, "Invalid cache mode -- must be auto, on or off\n");
+					usage();
+				}
+				break;
+			case 'M':
+				if (!strcmp(optarg, "auto")) multi_plane_allowed = 1;
+				else if (!strcmp(optarg, "off")) multi_plane_allowed = 0;
+				else {
+					fprintf(stderr, "Invalid multi-plane mode -- must be auto or off\n");
+					usage();
+				}
+				break;
 			case 'v': verify_after_write = 1; break;
 			case 'w': check_status = 1; break;
-			case 'x': chip_select = strtol(optarg, NULL, 0); 
+			case 'x':
+				if (!strcmp(optarg, "both")) {
+					num_chips = 2;
+					break;
+				}
+				chip_select = strtol(optarg, NULL, 0); 
 				if (chip_select != 0 && chip_select != 1) {
-					fprintf(stderr, "Invalid chip number -- must be 0 or 1\n");
+					fprintf(stderr, "Invalid chip number -- must be 0, 1 or both\n");
 					usage();
 				}
 				break;
@@ -811,14 +2724,126 @@ int main (int argc,char **argv)
 			case 'f': force = 1; break;
 			case 's': start_block = strtol(optarg, NULL, 0); break;
 			case 'q': quick_check = 1; break;
+			case 'S':
+				if (num_sim_specs < GANG_MAX) sim_specs[num_sim_specs++] = optarg;
+				sim_spec = optarg;
+				break;
+			case 'u':
+				if (num_device_specs < GANG_MAX) device_specs[num_device_specs++] = optarg;
+				device_spec = optarg;
+				break;
+			case 'c': coalesce = 1; break;
+			case 'j': jobs = strtol(optarg, NULL, 0);
+				jobs_set = 1;
+				break;
+			case 'B': base_filename = optarg; break;
+			case 'D': server_path = optarg; break;
+			case 'F':
+				for (image_format = IMAGE_ZLIB; image_format > IMAGE_RAW; image_format--)
+					if (!strcmp(optarg, image_format_names[image_format])) break;
+				if (strcmp(optarg, image_format_names[image_format])) {
+					fprintf(stderr, "Invalid image format -- must be raw, sparse or zlib\n");
+					usage();
+				}
+				break;
+			case 'm': make_manifest = 1; break;
+			case 'R': resume = 1; break;
+			case 'P': profiling = 1; break;
+			case 'r': reread_tries = strtol(optarg, NULL, 0); break;
+			case 'k':
+				if (!strcmp(optarg, "read")) bad_block_policy = BBT_READ;
+				else if (!strcmp(optarg, "skip")) bad_block_policy = BBT_SKIP;
+				else if (!strcmp(optarg, "ignore")) bad_block_policy = BBT_IGNORE;
+				else {
+					fprintf(stderr, "Invalid bad block policy -- must be read, skip or ignore\n");
+					usage();
+				}
+				break;
+			case 'p': queue_depth = strtol(optarg, NULL, 0);
+				if (queue_depth < 1 || queue_depth > QUEUE_DEPTH_MAX) {
+					fprintf(stderr, "Invalid queue depth -- must be 1 to %d\n", QUEUE_DEPTH_MAX);
+					usage();
+				}
+				break;
             case '?':
             default:
                 usage();
          }
 	}
+}
+
+/* serve: bring-up is done, so wait for requests.  Returns in a child with
+   the request's command, its options in force on top of those given to
+   serve, and its output going to the client; *argc and *argv are what is
+   left after the options. */
+static char *serve_request(u32 flashid, int *argc, char ***argv) {
+	char **req, *command;
+	int n, was_coalesced = coalesce;
+	u32 id;
+
+	n = serve_start(server_path ? server_path : serve_default_path(), &req);
+	command = req[1];
+	/* getopt can only be restarted from argv[1], so the command goes */
+	req[1] = req[0];
+	req++;
+	n--;
+	long_options(n, req);
+	num_sim_specs = num_device_specs = 0;
+#ifdef __GLIBC__
+	optind = 0;
+#else
+	optreset = 1;
+	optind = 1;
+#endif
+	parse_options(n, req);
+	if (profiling) profile_start();
+	if (num_sim_specs || num_device_specs) {
+		fprintf(stderr, "Error: -S and -u are given to serve, not to each command\n");
+		exit(1);
+	}
+	if (coalesce && !was_coalesced && !infectus_probe_batch()) {
+		printf("Firmware does not accept coalesced commands; sending them one at a time\n");
+		coalesce = 0;
+	}
+	if (!subpage_size_set) tune_lookup();
+
+	/* the last request may have left the other chip selected, and the
+	   chip may have been changed since */
+	infectus_selectflash(chip_select);
+	current_chip = chip_select;
+	id = infectus_getflashid();
+	if (id != flashid) {
+		printf("Flash ID is now %x, not %x; restart the server\n", id, flashid);
+		exit(1);
+	}
+	*argc = n - optind;
+	*argv = req + optind;
+	return command;
+}
+
+int main (int argc,char **argv)
+{
+	int retval;
+	char *filename = NULL, *filename1 = NULL;
+	char *journal_name = NULL;	/* program: where to keep the journal */
+	
+	progname = argv[0];
+	printf("amoxiflash version %s, (c) 2008,2009 bushing\n", VERSION);
+	
+	if (argc < 2) usage();
+	char *command = argv[1];
+	/* as given, for the server */
+	int client_argc = argc;
+	char **client_argv = malloc((argc + 1) * sizeof *argv);
+	memcpy(client_argv, argv, (argc + 1) * sizeof *argv);
+	optind = 2; // skip over command
+	long_options(argc, argv);
+	
+	parse_options(argc, argv);
 	argc -= optind;
 	argv += optind;
 	if (argc > 0) filename = argv[0];
+	if (argc > 1) filename1 = argv[1];
 
 	if (debug_mode) {
 		printf("command = %s\n", command);
@@ -827,13 +2852,32 @@ int main (int argc,char **argv)
 		printf("verify_after_write = %x\n", verify_after_write);
 		printf("check_status = %x\n", check_status);
 		printf("chip_select = %x\n", chip_select);
+		printf("num_chips = %x\n", num_chips);
 		printf("debug_mode = %x\n", debug_mode);
 		printf("force = %x\n", force);
 		printf("start_block = %x\n", start_block);
 		printf("quick_check = %x\n", quick_check);
+		printf("queue_depth = %x\n", queue_depth);
+		printf("coalesce = %x\n", coalesce);
+		printf("jobs = %x\n", jobs);
+		printf("base_filename = %s\n", base_filename);
+		printf("make_manifest = %x\n", make_manifest);
+		printf("reread_tries = %x\n", reread_tries);
+		printf("bad_block_policy = %x\n", bad_block_policy);
+		printf("erase_all = %x\n", erase_all);
+		printf("cache_mode = %x\n", cache_mode);
+		printf("multi_plane_allowed = %x\n", multi_plane_allowed);
+		printf("server_path = %s\n", server_path);
+		printf("image_format = %x\n", image_format);
+		printf("resume = %x\n", resume);
+		printf("profiling = %x\n", profiling);
 		printf("filename = %s\n", filename);
+		printf("ecc = %s\n", ecc_implementation());
 	}
 
+	/* files of another geometry */
+	if (chip_override) set_geometry(chip_override);
+
 	if (!strcmp(command, "check")) {
 		if (!filename) {
 			fprintf(stderr, "Error: check requires a filename\n");
@@ -863,22 +2907,111 @@ int main (int argc,char **argv)
 		retval = generate_checksums(filename);
 		exit(retval);
 	}
-	usb_init();
-	atexit(usb_exit_handler);
-//	usb_set_debug(2);
- 	if ((h = locate_infectus())==0) 
-	{
-		printf("Could not open the infectus device\n");
+
+	if (!strcmp(command, "convert")) {
+		if (!filename || !filename1) {
+			fprintf(stderr, "Error: convert requires an input and an output file\n");
+			usage();
+		}
+
+		retval = convert_image(filename, filename1);
+		exit(retval);
+	}
+
+	if (!strcmp(command, "merge")) {
+		if (!filename) {
+			fprintf(stderr, "Error: merge requires an output file and the images to merge\n");
+			usage();
+		}
+
+		retval = merge_images(filename, argc - 1, argv + 1);
+		exit(retval);
+	}
+
+	if (!strcmp(command, "list")) {
+		usb_init();
+		list_infectus();
+		exit(0);
+	}
+
+	/* everything else needs the programmer, which the server has open */
+	if (server_path && strcmp(command, "serve"))
+		exit(serve_client(server_path, client_argc, client_argv));
+	if (!strcmp(command, "serve") && (num_sim_specs > 1 || num_device_specs > 1)) {
+		fprintf(stderr, "Error: serve drives one programmer; start one per device, each with its own -D\n");
 		exit(1);
 	}
 
+	if (!strcmp(command, "program") || !strcmp(command, "dump") || !strcmp(command, "erase")) {
+		char *targets[GANG_MAX];
+		int ntargets = 0, i;
+
+		if (num_sim_specs > 1) {
+			for (i = 0; i < num_sim_specs; i++) {
+				targets[i] = malloc(16);
+				sprintf(targets[i], "sim%d", i);
+			}
+			ntargets = num_sim_specs;
+		} else if (!sim_spec && num_device_specs > 0) {
+			struct usb_device *devs[GANG_MAX];
+			usb_init();
+			for (i = 0; i < num_device_specs; i++) {
+				int n, j, k;
+				n = find_infectus(device_specs[i], devs, GANG_MAX);
+				if (n == 0) printf("No programmer matches '%s'\n", device_specs[i]);
+				for (j = 0; j < n && ntargets < GANG_MAX; j++) {
+					char name[32];
+					infectus_devname(devs[j], name, sizeof name);
+					for (k = 0; k < ntargets; k++)
+						if (!strcmp(targets[k], name)) break;
+					if (k == ntargets) targets[ntargets++] = strdup(name);
+				}
+			}
+			if (ntargets == 0) exit(1);
+		}
+
+		if (ntargets > 1) {
+			i = gang_start(ntargets, targets);
+			/* from here on we are a child driving target i */
+			if (num_sim_specs > 1) sim_spec = sim_specs[i];
+			else device_spec = targets[i];
+			if (!strcmp(command, "dump") && filename)
+				filename = gang_filename(filename, targets[i]);
+			/* every programmer keeps its own journal */
+			else if (!strcmp(command, "program") && filename)
+				journal_name = gang_filename(filename, targets[i]);
+		} else if (ntargets == 1 && !sim_spec) {
+			device_spec = targets[0];
+		}
+	}
+	if (sim_spec) {
+		if ((transport = sim_open(sim_spec))==0) exit(1);
+	} else {
+		usb_init();
+	//	usb_set_debug(2);
+		if ((h = locate_infectus(device_spec))==0) 
+		{
+			printf("Could not open the infectus device\n");
+			exit(1);
+		}
+		transport = &usb_transport;
+	}
+	atexit(transport_exit_handler);
+	if (profiling) profile_start();
+
 	u32 flashid = 0;
 	infectus_reset();
 	infectus_get_version();
 	infectus_get_loader_version();
 	infectus_check_pld_id();
+	if (!subpage_size_set) tune_lookup();
 	infectus_selectflash(chip_select);
+	current_chip = chip_select;
 	usleep(1000);
+	if (coalesce && !infectus_probe_batch()) {
+		printf("Firmware does not accept coalesced commands; sending them one at a time\n");
+		coalesce = 0;
+	}
 	flashid = infectus_getflashid();
 		
 //	printf("ID = %x\n", flashid);
@@ -889,51 +3022,94 @@ int main (int argc,char **argv)
 		
 	printf("ID = %x\n", flashid);
 
-// todo: make a proper database of chip types
-	switch(flashid) {
-		case 0xECF1: printf("Detected K9F1G08X0A 128Mbyte flash\n"); 
-			num_blocks = 1024;
-			break;
-		case 0xADDC: printf("Detected Hynix 512Mbyte flash\n");
-			num_blocks = 4096;
-			break;
-		case 0xECDC: printf("Detected Samsung 512Mbyte flash\n"); ;
-			num_blocks = 4096;
-			break;	
-		case 0x2CDC: printf("Detected Micron 512Mbyte flash\n"); ;
-			num_blocks = 4096;
-			break;	
-		case 0x98DC: printf("Detected Toshiba 512Mbyte flash\n"); ;
-			num_blocks = 4096;
-			break;
-		case 0:
-			printf("No flash chip detected; are you sure target device is powered on?\n");
-			exit(1);
-		default: 
-			printf("Unknown flash ID %04x\n", flashid);
-			printf("If this is correct, please notify the author.\n");
+	if (!flashid) {
+		printf("No flash chip detected; are you sure target device is powered on?\n");
+		exit(1);
+	}
+	const struct chip_type *chip = chip_type = chip_override ? chip_override : detect_chip(flashid);
+	if (!chip) {
+		printf("Unknown flash ID %04x\n", flashid);
+		printf("If this is correct, please notify the author, or give its geometry\n");
+		printf("with -g id of a chip that has the same.\n");
+		exit(1);
+	}
+	if (!strcmp(command, "serve")) {
+		printf("Detected %s flash\n", chip->name);
+		chip_print(chip);
+		command = serve_request(flashid, &argc, &argv);
+		filename = argc > 0 ? argv[0] : NULL;
+		filename1 = argc > 1 ? argv[1] : NULL;
+		if (chip_override) chip = chip_type = chip_override;
+	}
+	printf("Detected %s flash\n", chip->name);
+	chip_print(chip);
+	set_geometry(chip);
+	cache_read = cache_mode == CACHE_ON || (cache_mode == CACHE_AUTO && chip->cache_read);
+	cache_program = cache_mode == CACHE_ON || (cache_mode == CACHE_AUTO && chip->cache_program);
+	multi_plane = multi_plane_allowed && chip->planes > 1 && chip->plane_program;
+	if (debug_mode) printf("cache read %s, cache program %s, multi-plane %s\n",
+		cache_read ? "on" : "off", cache_program ? "on" : "off", multi_plane ? "on" : "off");
+
+	if (num_chips > 1) {
+		/* both chips are driven with the geometry detected on chip 0 */
+		u32 flashid1;
+		select_chip(1);
+		flashid1 = infectus_getflashid();
+		printf("Chip 1 ID = %x\n", flashid1);
+		if (flashid1 != flashid) {
+			printf("Chip 1 does not match chip 0; use -x 0 or -x 1 to work on one chip\n");
 			exit(1);
+		}
+		select_chip(0);
 	}
 
+	/* before anything is erased, which could take a mark with it */
+	if (!strcmp(command, "bbt") || (bad_block_policy != BBT_IGNORE &&
+	    (!strcmp(command, "program") || !strcmp(command, "dump") ||
+	     !strcmp(command, "erase") || !strcmp(command, "tune")))) {
+		int c, scan = BBT_SCAN;
+		/* dump only reads, and with "read" the table just saves re-reading
+		   bad blocks: not worth a scan */
+		if (!strcmp(command, "dump") && bad_block_policy == BBT_READ) scan = BBT_CACHED;
+		for (c = 0; c < num_chips; c++) {
+			if (num_chips > 1) {
+				select_chip(c);
+				printf("Chip %d:\n", c);
+			}
+			bbt_get(c, flashid, scan);
+		}
+		if (num_chips > 1) select_chip(0);
+	}
+	if (!strcmp(command, "bbt")) exit(0);
+
 	start_time = time(NULL);
 	if(!strcmp(command, "program")) {
-		int blockno = start_block;
+		int blockno = start_block, first;
 
 		if (!filename) {
 			fprintf(stderr, "Error: you must specify a filename to program\n");
 			usage();
 		}
 		printf("Programming file %s into flash\n", filename);
-		FILE *fp = fopen(filename, "rb");
-		if(!fp) {
+		struct image *imgs[2];
+		struct image *img = imgs[0] = imgs[1] = image_open(filename);
+		if(!img) {
 			perror("Couldn't open file: ");
 			exit(1);
 		}
-		check_file_validity(fp);
-		fseek(fp, 0, SEEK_END);
-		u64 file_length = ftello(fp);
-		fseek(fp, 0, SEEK_SET);
-		u64 num_pages = file_length / (page_size + spare_size);
+		check_file_validity(img);
+		if (num_chips > 1 && filename1) {
+			printf("Programming file %s into chip 1\n", filename1);
+			imgs[1] = image_open(filename1);
+			if (!imgs[1]) {
+				perror("Couldn't open file: ");
+				exit(1);
+			}
+			check_file_validity(imgs[1]);
+			if (imgs[1]->num_pages < img->num_pages) img = imgs[1];
+		}
+		u64 file_length = img->size;
+		u64 num_pages = img->num_pages;
 		if (num_pages < (num_blocks * pages_per_block)) {
 			fprintf(stderr, "WARNING: File is too short; file is %u blocks, chip is %u blocks\n",
 				(u32)num_pages, num_blocks * pages_per_block);
@@ -946,42 +3122,166 @@ int main (int argc,char **argv)
 
 		printf("File size: %"PRIu64" bytes / %"PRIu64" pages / %"PRIu64" blocks\n", 
 			file_length, num_pages, num_pages / pages_per_block);
-		for (; blockno < num_blocks; blockno++) {
-			flash_program_block(fp, blockno);
+		/* in test mode nothing is written, so nothing is finished */
+		struct journal *journal = NULL;
+		if (!test_mode) {
+			char key[160];
+			program_journal_key(key, sizeof key, flashid, filename,
+				imgs[1] != imgs[0] ? filename1 : NULL);
+			journal = journal_open(journal_name ? journal_name : filename, key, num_blocks, resume);
 		}
-		fclose(fp);
+		if (base_filename) {
+			struct image *base;
+			u8 *dirty;
+			u32 ndirty = 0, i;
+
+			if (imgs[1] != imgs[0]) {
+				fprintf(stderr, "Error: --base needs the same image on both chips\n");
+				exit(1);
+			}
+			if (!(base = image_open(base_filename))) {
+				perror("Couldn't open base file: ");
+				exit(1);
+			}
+			printf("Assuming the chip holds %s; only blocks that differ will be written\n",
+				base_filename);
+			struct manifest *mbase = manifest_open(base_filename);
+			struct manifest *mnew = manifest_open(filename);
+			if (mbase && mnew) {
+				/* both indexed: compare block hashes, read neither image */
+				printf("Comparing manifests\n");
+				dirty = calloc(num_blocks, 1);
+				for (i = 0; i < num_blocks; i++)
+					dirty[i] = i >= mbase->hdr->num_blocks ||
+						mbase->block_hash[i] != mnew->block_hash[i];
+			} else {
+				if (!jobs_set) jobs = 0;
+				dirty = diff_images(base, img, num_blocks);
+			}
+			manifest_close(mbase);
+			manifest_close(mnew);
+			image_close(base);
+			for (i = blockno; i < num_blocks; i++) ndirty += dirty[i];
+			printf("%u of %u blocks differ\n", ndirty, num_blocks - blockno);
+			for (; blockno < num_blocks; blockno++) {
+				if (journal_done(journal, blockno)) continue;
+				first = blockno;
+				if (program_pair(blockno) && dirty[blockno] && dirty[blockno + 1])
+					flash_program_planes(imgs[0], blockno++, 0);
+				else if (dirty[blockno]) flash_program_block(imgs, num_chips, blockno, 0);
+				program_done(imgs, journal, first, blockno);
+			}
+			free(dirty);
+		} else {
+			for (; blockno < num_blocks; blockno++) {
+				if (journal_done(journal, blockno)) continue;
+				first = blockno;
+				if (program_pair(blockno)) flash_program_planes(imgs[0], blockno++, 1);
+				else flash_program_block(imgs, num_chips, blockno, 1);
+				program_done(imgs, journal, first, blockno);
+			}
+		}
+		journal_finish(journal);
+		if (imgs[1] != imgs[0]) image_close(imgs[1]);
+		image_close(imgs[0]);
+		if (make_manifest) manifest_close(get_manifest(filename));
 		exit(0);
 	}
 
 	if(!strcmp(command, "dump")) {
 		u64 length, offset;
-		u32 blockno;
 
-		length = num_blocks * pages_per_block;
-		offset = start_block * pages_per_block * (page_size + spare_size);
+		length = (u64)num_blocks * pages_per_block * (page_size + spare_size);
+		offset = (u64)start_block * pages_per_block * (page_size + spare_size);
 		printf("Dumping flash @ 0x%"PRIx64" (0x%"PRIx64" bytes) into %s\n", 
 				offset, length-offset, filename);
 
-		FILE *fp = fopen(filename, "wb");
-		if(!fp) {
-			perror("Couldn't open file for writing: ");
-			exit(1);
+		struct image *imgs[2];
+		struct journal *journals[2] = { NULL, NULL };
+		char *names[2], key[128];
+		int c;
+		names[0] = filename;
+		if (num_chips > 1) {
+			names[0] = filename1 ? filename : gang_filename(filename, "chip0");
+			names[1] = filename1 ? filename1 : gang_filename(filename, "chip1");
+			printf("Chip 0 -> %s, chip 1 -> %s\n", names[0], names[1]);
 		}
-		for(blockno = start_block; blockno < num_blocks; blockno++) {
-//			printf("\rDumping block %x", blockno); fflush(stdout);
-			flash_dump_block(fp, blockno);
+		snprintf(key, sizeof key, "dump %04x %d+%d %d %u %s", flashid, page_size, spare_size,
+			pages_per_block, num_blocks, image_format_names[image_format]);
+		for (c = 0; c < num_chips; c++) {
+			journals[c] = journal_open(names[c], key, num_blocks, resume);
+			if (journals[c] && journals[c]->resumed) {
+				imgs[c] = image_reopen(names[c], (u64)num_blocks * pages_per_block, image_format);
+				if (!imgs[c]) {
+					perror(names[c]);
+					printf("The image the journal goes with can't be carried on; remove %s.journal to start over\n",
+						names[c]);
+					exit(1);
+				}
+			} else if (image_format != IMAGE_RAW)
+				imgs[c] = image_create_sparse(names[c], (u64)num_blocks * pages_per_block,
+					image_format);
+			else
+				imgs[c] = image_create(names[c],
+					(u64)num_blocks * pages_per_block * (page_size + spare_size));
+			if(!imgs[c]) {
+				perror("Couldn't open file for writing: ");
+				exit(1);
+			}
 		}
+		flash_dump(imgs, journals, num_chips, start_block, num_blocks);
 		printf("Done!\n");
-		fclose(fp);
+		for (c = 0; c < num_chips; c++) {
+			image_close(imgs[c]);
+			journal_finish(journals[c]);
+			if (make_manifest) manifest_close(build_manifest(names[c]));
+		}
 		exit(0);
 	}
 
+	if(!strcmp(command, "tune")) {
+		u32 blockno = start_block ? start_block : num_blocks - 1;
+		while (!start_block && blockno > 0 && block_is_bad(0, blockno)) blockno--;
+		retval = tune_subpage_size(blockno);
+		exit(retval);
+	}
+
 	if(!strcmp(command, "erase")) {
-	  int blockno;
+	  int blockno, c, b, step, erase[2];
+	  u32 erased = 0, blank = 0;
+	  int blank_check = !erase_all && (coalesce || queue_depth > 1);
 	  printf("Erasing %d blocks\n", num_blocks);
-	  for (blockno=0; blockno < num_blocks; blockno++) 
-	    infectus_eraseblock(blockno);
-	  printf("Done!\n");
+	  if (!erase_all && !blank_check)
+	    printf("Not checking for blank blocks: without -c or -p that is slower than erasing\n");
+	  for (blockno=0; blockno < num_blocks; blockno += step) {
+	    /* with two planes, even and odd blocks in pairs */
+	    step = multi_plane && blockno % 2 == 0 && blockno + 1 < num_blocks ? 2 : 1;
+	    if (blockno % 64 == 0) {
+	      printf("\r%04x", blockno);
+	      fflush(stdout);
+	    }
+	    for (c = 0; c < num_chips; c++) {
+	      if (num_chips > 1) select_chip(c);
+	      for (b = 0; b < step; b++) {
+	        erase[b] = !block_is_bad(c, blockno + b);
+	        if (erase[b] && blank_check && flash_block_blank(blockno + b)) {
+	          blank++;
+	          erase[b] = 0;
+	        }
+	      }
+	      if (step == 2 && erase[0] && erase[1]) {
+	        infectus_eraseplanes(blockno);
+	        erased += 2;
+	        continue;
+	      }
+	      for (b = 0; b < step; b++) {
+	        if (!erase[b]) continue;
+	        infectus_eraseblock(blockno + b);
+	        erased++;
+	      }
+	    }
+	  }
+	  printf("\rDone!  %u blocks erased, %u already blank and skipped\n", erased, blank);
 	  exit(0);
 	}
 #if 0
@@ -1016,33 +3316,87 @@ int main (int argc,char **argv)
 	exit(1);  // not reached
 }	
 
-usb_dev_handle *locate_infectus(void) 
-{
-	unsigned char located = 0;
+/* Name a device the way -u accepts it: "bus:address".  Both are three
+   digits in practice; the precision keeps the name short whatever they
+   are, as it goes into 32-byte buffers. */
+static void infectus_devname(struct usb_device *dev, char *buf, int len) {
+	snprintf(buf, len, "%.12s:%.12s", dev->bus->dirname, dev->filename);
+}
+
+static void infectus_serial(struct usb_device *dev, char *buf, int len) {
+	usb_dev_handle *dh;
+	buf[0] = 0;
+	if (!dev->descriptor.iSerialNumber) return;
+	if (!(dh = usb_open(dev))) return;
+	if (usb_get_string_simple(dh, dev->descriptor.iSerialNumber, buf, len) < 0) buf[0] = 0;
+	usb_close(dh);
+}
+
+/* Does dev match a -u spec: "all", "bus:address" or a serial number? */
+static int infectus_matches(struct usb_device *dev, const char *spec) {
+	char serial[128];
+	const char *colon;
+
+	if (!spec || !strcmp(spec, "all")) return 1;
+	colon = strchr(spec, ':');
+	if (colon)
+		return strtol(spec, NULL, 10) == strtol(dev->bus->dirname, NULL, 10) &&
+			strtol(colon + 1, NULL, 10) == strtol(dev->filename, NULL, 10);
+	infectus_serial(dev, serial, sizeof serial);
+	return serial[0] && !strcmp(serial, spec);
+}
+
+/* Collect the Infectus devices matching spec, in bus order */
+int find_infectus(const char *spec, struct usb_device **devs, int max) {
 	struct usb_bus *bus;
 	struct usb_device *dev;
-	usb_dev_handle *device_handle = 0;
- 		
+	int n = 0;
+
 	usb_find_busses();
 	usb_find_devices();
- 
- 	for (bus = usb_busses; bus; bus = bus->next) {
+
+	for (bus = usb_busses; bus; bus = bus->next) {
 		for (dev = bus->devices; dev; dev = dev->next) {
 //			printf ("idVendor=%hx\n", dev->descriptor.idVendor);
-			if (dev->descriptor.idVendor == 0x10c4) {	
-				located++;
-				device_handle = usb_open(dev);
-				printf("infectus Device Found @ Address %s \n", dev->filename);
-				printf("infectus Vendor ID 0x0%x\n",dev->descriptor.idVendor);
-				printf("infectus Product ID 0x0%x\n",dev->descriptor.idProduct);
-			}
-//			else printf("** usb device %s found **\n", dev->filename);			
-		}	
-  }
-
-  if (device_handle==0) return (0);
-  else return (device_handle);  	
+			if (dev->descriptor.idVendor == 0x10c4 && infectus_matches(dev, spec) && n < max)
+				devs[n++] = dev;
+		}
+	}
+	return n;
 }
 
-   
+void list_infectus(void) {
+	struct usb_device *devs[GANG_MAX];
+	char name[32], serial[128];
+	int i, n;
+
+	n = find_infectus(NULL, devs, GANG_MAX);
+	printf("%d Infectus device%s found\n", n, n == 1 ? "" : "s");
+	for (i = 0; i < n; i++) {
+		infectus_devname(devs[i], name, sizeof name);
+		infectus_serial(devs[i], serial, sizeof serial);
+		printf("  %-10s product 0x%04x  serial %s\n", name,
+			devs[i]->descriptor.idProduct, serial[0] ? serial : "(none)");
+	}
+}
 
+usb_dev_handle *locate_infectus(const char *spec) 
+{
+	struct usb_device *devs[GANG_MAX], *dev;
+	usb_dev_handle *device_handle = 0;
+	int n;
+
+	n = find_infectus(spec, devs, GANG_MAX);
+	if (n == 0) return 0;
+	if (n > 1) printf("%d matching devices found; using the first.  Pass -u to choose.\n", n);
+
+	dev = devs[0];
+	/* tuning is remembered per unit, so prefer the serial number */
+	infectus_serial(dev, device_id, sizeof device_id);
+	if (!device_id[0]) infectus_devname(dev, device_id, sizeof device_id);
+	device_handle = usb_open(dev);
+	printf("infectus Device Found @ Address %s:%s \n", dev->bus->dirname, dev->filename);
+	printf("infectus Vendor ID 0x0%x\n",dev->descriptor.idVendor);
+	printf("infectus Product ID 0x0%x\n",dev->descriptor.idProduct);
+	return device_handle;
+}
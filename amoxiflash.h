@@ -25,9 +25,222 @@ typedef unsigned int u32;
 #define ECC_WRONG 1
 #define ECC_INVALID 2
 #define ECC_BLANK 3
+#define ECC_CORRECTED 4		/* was WRONG; single-bit errors repaired */
 
 typedef unsigned long long int u64;
 
-u8 * calc_page_ecc(u8 *data);
+/* The Hamming ECC: 4 bytes per 512-byte sector, together at the end of the
+   spare area (bytes 48-63 of a 2048+64 page) */
+#define ECC_SECTORS (page_size / 512)
+#define ECC_SECTORS_MAX 16
+#define ECC_OFFSET (page_size + spare_size - 4 * ECC_SECTORS)
+
+void calc_page_ecc(const u8 *data, u8 *ecc);
 int check_ecc(u8 *page);
+int correct_page_ecc(u8 *page);
+int correct_sector(u8 *data, u8 *stored);
+const char *ecc_implementation(void);
+
+/* Page recovery from several copies (merge.c) */
+#define MERGE_MAX 16
+enum { MERGE_SAME, MERGE_ECC, MERGE_SECTORS, MERGE_VOTE, MERGE_FAILED };
+int merge_page(u8 **copies, int n, u8 *out, int *ecc);
+
+/* A transport carries Infectus command packets to and from a device.
+   bulk_write / bulk_read behave like their libusb counterparts. */
+struct transport {
+	const char *name;
+	int (*reset)(void);
+	int (*bulk_write)(u8 *buf, int len, int timeout);
+	int (*bulk_read)(u8 *buf, int len, int timeout);
+	const char *(*strerror)(void);
+	void (*close)(void);
+};
+
+/* A page is read in whole subpage_size transfers, so page buffers hold
+   page_size + spare_size rounded up to that and sit pagebuf_size apart.
+   Fixed-size buffers are PAGEBUF_MAX, enough for 8KB pages. */
+#define SUBPAGE_MAX 0x840
+#define PAGEBUF_MAX 16384
+
+extern struct transport *transport;
+extern int debug_mode;
+extern int page_size, spare_size, pages_per_block, pagebuf_size;
+
+struct transport *sim_open(const char *spec);
+
+/* A dump image, mapped into memory.  A sparse image holds only the pages
+   that aren't all FF; a compressed one is a sparse image with each block
+   deflated on its own: see image.c. */
+enum { IMAGE_RAW, IMAGE_SPARSE, IMAGE_ZLIB };
+
+#define SPARSE_VERSION 2	/* 1 had no compression field */
+#define SPARSE_V1_HEADER 64
+#define SPARSE_ZLIB 1		/* compression: each block's pages deflated */
+
+struct sparse_header {
+	char magic[8];		/* "AMXSPARS" */
+	u32 version;
+	u32 header_size;
+	u32 page_len;		/* page_size + spare_size */
+	u32 pages_per_block;
+	u64 num_pages;
+	u64 num_blocks;
+	u64 present;		/* pages stored */
+	u64 data_offset;	/* bitmap at header_size, then the block table */
+	u32 compression;	/* 0 or SPARSE_ZLIB, whose frame lengths follow the block table */
+	u32 reserved;
+};
+
+struct image {
+	int fd;
+	u8 *map;
+	u64 size;		/* as a raw image */
+	u64 num_pages;
+	int writable;
+	char *filename;
+	int format;
+	/* sparse images */
+	u64 map_size;
+	u8 *bitmap;		/* bit per page, set if stored */
+	u64 *block_offset;	/* [num_blocks], where the block's stored pages start */
+	u32 *block_length;	/* [num_blocks], compressed images: frame length */
+	u64 num_blocks, data_end;
+	u8 *blank;		/* an all-FF page */
+	u8 *block_buf;		/* the block being assembled or written */
+	u8 *pack_buf;
+	u8 *frame_buf;		/* a compressed block */
+	int block_cur;		/* -1 if none */
+	int block_dirty;
+	u8 **decoded;		/* compressed images being read: blocks decoded so far */
+};
+
+struct image *image_open(const char *filename);
+struct image *image_create(const char *filename, u64 size);
+struct image *image_create_sparse(const char *filename, u64 num_pages, int format);
+struct image *image_reopen(const char *filename, u64 num_pages, int format);
+u8 *image_page(struct image *img, u32 pageno);
+u8 *image_block(struct image *img, u32 blockno);
+int image_write_page(struct image *img, u32 pageno, const u8 *src);
+int image_sync(struct image *img, u32 blockno);
+void image_release(struct image *img, u32 first_page, u32 count);
+void image_close(struct image *img);
+
+int gang_start(int n, char **names);
+
+/* Server mode (serve.c) */
+extern char *progname;
+int infectus_reset(void);
+const char *serve_default_path(void);
+int serve_start(const char *path, char ***argv);
+int serve_client(const char *path, int argc, char **argv);
+
+/* Image manifest (nand.bin.amx): per-page and per-block hashes, ECC status,
+   bit counts and a blank-page bitmap, laid out as below */
+#define MANIFEST_VERSION 1
+
+struct manifest_header {
+	char magic[8];		/* "AMXMANIF" */
+	u32 version;
+	u32 header_size;
+	u32 page_len;		/* page_size + spare_size */
+	u32 pages_per_block;
+	u64 num_pages;
+	u64 num_blocks;
+	u64 image_size;		/* the image this describes */
+	u64 image_mtime;	/* ns */
+	u8 reserved[8];
+};
+
+struct manifest {
+	struct manifest_header *hdr;
+	u64 *block_hash;	/* [num_blocks], hash of the block's page hashes */
+	u64 *page_hash;		/* [num_pages] */
+	u32 *sums;		/* [num_pages], set bits in the page data */
+	u8 *ecc;		/* [num_pages], check_ecc() result */
+	u8 *blank;		/* bit per page, set if all FF */
+	u8 *map;
+	u64 map_size;
+	int fd;
+	int writable;
+};
+
+char *manifest_filename(const char *image_filename);
+u64 page_hash(const u8 *data, int len);
+struct manifest *manifest_open(const char *image_filename);
+struct manifest *manifest_create(const char *image_filename, u64 num_pages);
+int manifest_finish(struct manifest *m, const char *image_filename);
+void manifest_close(struct manifest *m);
+
+/* Checkpoint journal (nand.bin.journal) of the blocks a dump or program
+   has finished, for --resume */
+struct journal {
+	int fd;
+	char *filename;
+	u32 num_blocks;
+	u8 *done;		/* [num_blocks], finished by an earlier run */
+	u32 resumed;		/* how many */
+};
+
+struct journal *journal_open(const char *image_filename, const char *key, u32 num_blocks, int resume);
+int journal_done(struct journal *j, u32 blockno);
+int journal_add(struct journal *j, u32 blockno);
+void journal_finish(struct journal *j);
+
+/* Device access, for the tuner */
+extern int subpage_size, test_mode;
+extern char device_id[];
+extern int infectus_revision, infectus_loader, infectus_pld;
+int infectus_eraseblock(unsigned int blockno);
+int infectus_readflashpage(u8 *dstbuf, unsigned int pageno);
+int infectus_writeflashpage(u8 *dstbuf, unsigned int pageno);
+int flash_isFF(u8 *buf, int len);
+
+int tune_lookup(void);
+int tune_subpage_size(u32 blockno);
+
+/* Chip database (chips.c).  Timings are worst case, in usec. */
+struct chip_type {
+	u32 id;			/* first two ID bytes */
+	char name[48];
+	int page_size, spare_size, pages_per_block, num_blocks;
+	int planes;		/* even and odd blocks are in different planes */
+	u8 plane_program;	/* setup for a multi-plane program's second page */
+	u8 plane_erase;		/* goes between the two erase setups, if any */
+	int cache_read, cache_program;	/* takes 31h/3Fh, 15h */
+	int t_r, t_prog, t_erase;
+};
+
+#define ONFI_PARAM_LEN 256
+#define ONFI_PARAM_COPIES 3
+
+const struct chip_type *find_chip_type(u32 id);
+u32 onfi_crc(const u8 *p, int len);
+int chip_from_onfi(struct chip_type *c, const u8 *param, int len);
+int chip_from_id(struct chip_type *c, const u8 *id);
+void chip_print(const struct chip_type *c);
+
+/* Bad block tables (bbt.c), one per chip */
+enum { BBT_READ, BBT_SKIP, BBT_IGNORE };
+extern int bad_block_policy;
+extern int num_blocks;
+int infectus_readcolumn(u8 *dstbuf, unsigned int pageno, int column, int len);
+int infectus_readspares(u8 *dst, unsigned int *pages, int count);
+enum { BBT_CACHED, BBT_SCAN };	/* whether bbt_get() scans */
+int bbt_get(int chip, u32 flashid, int scan);
+int block_is_bad(int chip, u32 blockno);
+
 
+/* Profiling (profile.c): round trip histograms per command, and where the
+   time went by phase */
+enum { PHASE_OTHER, PHASE_READ, PHASE_COMPARE, PHASE_ERASE, PHASE_PROGRAM,
+	PHASE_VERIFY, PHASE_STATUS, PHASES };
+/* keys past the NAND opcodes */
+enum { PROFILE_SEND = 256, PROFILE_RECV, PROFILE_OTHER, PROFILE_BATCH, PROFILE_KEYS };
+extern int profiling;
+u64 profile_now(void);
+int profile_key(const u8 *packet);
+void profile_record(int key, int out_bytes, int in_bytes, u64 start);
+int profile_enter(int phase);
+void profile_leave(int prev);
+void profile_start(void);
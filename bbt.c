@@ -0,0 +1,235 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Bad block tables.  The factory marks a bad block with a byte other than
+   FF at the start of the spare area of its first or second page; erasing
+   the block can wipe the mark, so it must be read before anything else
+   touches the chip.  The scan reads the spare areas of those two pages of
+   every block, batched with -c or queued with -p.  program, erase and
+   tune always scan: nothing short of reading every mark tells two chips
+   of a type apart once they are erased, or hold the same image.  Tables
+   are kept in ~/.amoxiflash-bbt against the chip ID, one for each chip of
+   that type seen, for dump, which only reads: there the longest one whose
+   bad blocks all still read as bad is taken without a scan. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amoxiflash.h"
+
+#define BBT_FILE ".amoxiflash-bbt"
+#define BBT_MARKER_PAGES 2	/* the mark is in the first or second page */
+#define BBT_LINE_MAX 16384
+#define BBT_SCAN_BLOCKS 64	/* blocks read in one go by the scan */
+
+u8 *bad_blocks[2];		/* per chip: 1 = bad */
+int bad_block_policy = BBT_READ;
+
+static char *bbt_path(void) {
+	static char path[1024];
+	const char *home = getenv("HOME");
+	snprintf(path, sizeof path, "%s/%s", home ? home : ".", BBT_FILE);
+	return path;
+}
+
+/* 1 if the block is marked bad, -1 if the marks couldn't be read */
+static int bbt_marked(u32 blockno) {
+	u8 mark;
+	int p;
+	for (p = 0; p < BBT_MARKER_PAGES; p++) {
+		if (infectus_readcolumn(&mark, blockno * pages_per_block + p, page_size, 1) != 1)
+			return -1;
+		if (mark != 0xff) return 1;
+	}
+	return 0;
+}
+
+/* Read the marks of every block.  A block whose marks can't be read is
+   taken as bad; the result is then -1 and isn't worth caching. */
+static int bbt_scan(u8 *bad) {
+	u8 *spare = malloc(BBT_SCAN_BLOCKS * BBT_MARKER_PAGES * spare_size);
+	unsigned int pages[BBT_SCAN_BLOCKS * BBT_MARKER_PAGES];
+	u32 blockno, i, n;
+	int p, r, ret = 0;
+
+	for (blockno = 0; blockno < num_blocks; blockno += n) {
+		printf("\rScanning for bad blocks: %04x", blockno);
+		fflush(stdout);
+		n = num_blocks - blockno < BBT_SCAN_BLOCKS ? num_blocks - blockno : BBT_SCAN_BLOCKS;
+		for (i = 0; i < n; i++)
+			for (p = 0; p < BBT_MARKER_PAGES; p++)
+				pages[i * BBT_MARKER_PAGES + p] = (blockno + i) * pages_per_block + p;
+		if (infectus_readspares(spare, pages, n * BBT_MARKER_PAGES) == 0) {
+			for (i = 0; i < n; i++) {
+				bad[blockno + i] = 0;
+				for (p = 0; p < BBT_MARKER_PAGES; p++)
+					if (spare[(i * BBT_MARKER_PAGES + p) * spare_size] != 0xff)
+						bad[blockno + i] = 1;
+			}
+			continue;
+		}
+		/* something failed: find out which blocks, one at a time */
+		for (i = 0; i < n; i++) {
+			r = bbt_marked(blockno + i);
+			if (r < 0) ret = -1;
+			bad[blockno + i] = r != 0;
+		}
+	}
+	printf("\r%-40s\r", "");
+	free(spare);
+	return ret;
+}
+
+/* A table for this chip type as stored: "<id> <blocks> <bad,bad,...>" or
+   "<id> <blocks> -".  Fills bad and returns the number of bad blocks, or
+   -1 if the line is for another chip type. */
+static int bbt_parse(const char *line, u32 flashid, u8 *bad) {
+	char key[16], *p, *end;
+	int n, count = 0;
+	u32 blockno;
+
+	n = snprintf(key, sizeof key, "%04x ", flashid);
+	if (strncmp(line, key, n)) return -1;
+	if (strtoul(line + n, &p, 10) != num_blocks || *p != ' ') return -1;
+	memset(bad, 0, num_blocks);
+	for (; *p; p = end) {
+		blockno = strtoul(p + 1, &end, 16);
+		if (end == p + 1) break;
+		if (blockno < num_blocks && !bad[blockno]) {
+			bad[blockno] = 1;
+			count++;
+		}
+	}
+	return count;
+}
+
+/* For dump, a table is taken for this chip if every block in it still
+   carries its mark: the blocks it leaves out are only read as usual */
+static int bbt_confirm(u8 *bad) {
+	u32 blockno;
+	for (blockno = 0; blockno < num_blocks; blockno++)
+		if (bad[blockno] && bbt_marked(blockno) != 1) return 0;
+	return 1;
+}
+
+/* The longest stored table for this chip type whose bad blocks the chip
+   bears out.  Returns 0 with it in bad, or -1 if there is none. */
+static int bbt_load(u32 flashid, u8 *bad) {
+	char *line = malloc(BBT_LINE_MAX);
+	u8 *candidate = malloc(num_blocks);
+	int count, best = -1;
+	FILE *fp;
+
+	if ((fp = fopen(bbt_path(), "r"))) {
+		while (fgets(line, BBT_LINE_MAX, fp)) {
+			count = bbt_parse(line, flashid, candidate);
+			if (count <= best || !bbt_confirm(candidate)) continue;
+			memcpy(bad, candidate, num_blocks);
+			best = count;
+		}
+		fclose(fp);
+	}
+	free(line);
+	free(candidate);
+	return best < 0 ? -1 : 0;
+}
+
+static void bbt_format(char *line, int len, u32 flashid, u8 *bad) {
+	u32 blockno;
+	int n, any = 0;
+
+	n = snprintf(line, len, "%04x %u ", flashid, num_blocks);
+	for (blockno = 0; blockno < num_blocks && n < len - 16; blockno++)
+		if (bad[blockno]) n += snprintf(line + n, len - n, "%s%x", any++ ? "," : "", blockno);
+	snprintf(line + n, len - n, "%s\n", any ? "" : "-");
+}
+
+static int bbt_store(u32 flashid, u8 *bad) {
+	char *line = malloc(BBT_LINE_MAX), *entry = malloc(BBT_LINE_MAX), *lines = NULL;
+	char key[16];
+	size_t used = 0;
+	int n;
+	FILE *fp;
+
+	bbt_format(entry, BBT_LINE_MAX, flashid, bad);
+	n = snprintf(key, sizeof key, "%04x ", flashid);
+	/* keep every other table, but not this one twice, nor one of this
+	   chip type in the old format (<id> <hash of page 0> ...) */
+	if ((fp = fopen(bbt_path(), "r"))) {
+		while (fgets(line, BBT_LINE_MAX, fp)) {
+			if (!strcmp(line, entry)) continue;
+			if (!strncmp(line, key, n) && strchr(line + n, ' ') &&
+			    strchr(strchr(line + n, ' ') + 1, ' ')) continue;
+			lines = realloc(lines, used + strlen(line) + 1);
+			strcpy(lines + used, line);
+			used += strlen(line);
+		}
+		fclose(fp);
+	}
+	free(line);
+
+	if (!(fp = fopen(bbt_path(), "w"))) {
+		perror("Couldn't save bad block table");
+		free(lines);
+		free(entry);
+		return -1;
+	}
+	if (lines) fputs(lines, fp);
+	fputs(entry, fp);
+	fclose(fp);
+	free(lines);
+	free(entry);
+	return 0;
+}
+
+/* Set up the table for the selected chip.  With BBT_SCAN the chip is
+   scanned and the table stored; with BBT_CACHED (dump) a stored table is
+   taken if one fits, and without one there is none.  Returns the number
+   of bad blocks. */
+int bbt_get(int chip, u32 flashid, int scan) {
+	u8 *bad;
+	int cached = 0, nbad = 0, scanned;
+	u32 blockno;
+
+	free(bad_blocks[chip]);
+	bad = bad_blocks[chip] = calloc(num_blocks, 1);
+	if (scan == BBT_CACHED) {
+		if (bbt_load(flashid, bad) < 0) {
+			free(bad_blocks[chip]);
+			bad_blocks[chip] = NULL;
+			printf("No bad block table for this chip; bbt makes one\n");
+			return 0;
+		}
+		cached = 1;
+	} else {
+		scanned = bbt_scan(bad);
+		if (scanned == 0) bbt_store(flashid, bad);
+		else printf("Some bad block marks couldn't be read; those blocks are left alone\n");
+	}
+
+	for (blockno = 0; blockno < num_blocks; blockno++) nbad += bad[blockno];
+	printf("%d bad blocks%s", nbad, cached ? " (cached)" : "");
+	for (blockno = 0, nbad = 0; blockno < num_blocks; blockno++)
+		if (bad[blockno]) printf("%s%04x", nbad++ % 12 ? " " : "\n  ", blockno);
+	printf("\n");
+	return nbad;
+}
+
+int block_is_bad(int chip, u32 blockno) {
+	return bad_blocks[chip] && blockno < num_blocks && bad_blocks[chip][blockno];
+}
@@ -0,0 +1,144 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Chip database.  What a chip looks like -- page, spare and block sizes,
+   planes, timing, and which of the faster commands it takes -- comes from
+   its ONFI parameter page if it has one, else from the table below by the
+   first two ID bytes, else from the extended ID bytes that most large-block
+   parts send after those two.  Page buffers and transfer sizes are all
+   derived from the result. */
+
+#include <stdio.h>
+#include <string.h>
+#include "amoxiflash.h"
+
+static const struct chip_type chip_types[] = {
+	/* id     name                    page  spare ppb  blocks planes     cache  tR   tPROG tBERS */
+	{ 0xECF1, "K9F1G08X0A 128Mbyte",   2048, 64,  64,  1024, 1, 0, 0,    0, 1,  25,  700,  2000 },
+	{ 0xADDC, "Hynix 512Mbyte",        2048, 64,  64,  4096, 2, 0x81, 0, 1, 1,  25,  700,  2000 },
+	{ 0xECDC, "Samsung 512Mbyte",      2048, 64,  64,  4096, 2, 0x81, 0, 1, 1,  25,  700,  2000 },
+	{ 0x2CDC, "Micron 512Mbyte",       2048, 64,  64,  4096, 2, 0x80, 0xd1, 1, 1, 25, 700, 3000 },
+	{ 0x98DC, "Toshiba 512Mbyte",      2048, 64,  64,  4096, 2, 0x81, 0, 1, 1,  25,  700,  3000 },
+	{ 0xECD5, "K9GAG08U0M 2Gbyte MLC", 4096, 128, 128, 4096, 2, 0x81, 0, 0, 1,  60,  2000, 10000 },
+};
+
+const struct chip_type *find_chip_type(u32 id) {
+	int i;
+	for (i = 0; i < sizeof chip_types / sizeof chip_types[0]; i++)
+		if (chip_types[i].id == id) return &chip_types[i];
+	return NULL;
+}
+
+static u32 le16(const u8 *p) {
+	return p[0] | p[1] << 8;
+}
+
+static u32 le32(const u8 *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+/* CRC-16 of an ONFI parameter page: polynomial 8005h, seeded with 4F4Eh */
+u32 onfi_crc(const u8 *p, int len) {
+	u32 crc = 0x4f4e;
+	int i, bit;
+	for (i = 0; i < len; i++) {
+		crc ^= p[i] << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000 ? crc << 1 ^ 0x8005 : crc << 1) & 0xffff;
+	}
+	return crc;
+}
+
+/* Copy an ONFI text field, without its padding */
+static void onfi_string(char *dst, const u8 *src, int len) {
+	while (len > 0 && (src[len - 1] == ' ' || src[len - 1] == 0)) len--;
+	memcpy(dst, src, len);
+	dst[len] = 0;
+}
+
+/* Fill c from an ONFI parameter page: the first of its redundant copies
+   whose CRC holds.  Returns -1 if none does. */
+int chip_from_onfi(struct chip_type *c, const u8 *param, int len) {
+	const u8 *p;
+	char maker[13], model[21];
+	u32 features, optional;
+
+	for (p = param; p + ONFI_PARAM_LEN <= param + len; p += ONFI_PARAM_LEN)
+		if (!memcmp(p, "ONFI", 4) && onfi_crc(p, 254) == le16(p + 254)) break;
+	if (p + ONFI_PARAM_LEN > param + len) return -1;
+
+	memset(c, 0, sizeof *c);
+	features = le16(p + 6);
+	optional = le16(p + 8);
+	onfi_string(maker, p + 32, 12);
+	onfi_string(model, p + 44, 20);
+	snprintf(c->name, sizeof c->name, "%s %s", maker, model);
+	c->page_size = le32(p + 80);
+	c->spare_size = le16(p + 84);
+	c->pages_per_block = le32(p + 92);
+	c->num_blocks = le32(p + 96) * p[100];	/* blocks per LUN * LUNs */
+	c->cache_program = optional & 1;
+	c->cache_read = (optional >> 1) & 1;
+	/* ONFI multi-plane ("interleaved") sequences: 80h-11h-80h, 60h-D1h-60h;
+	   byte 113 is the number of plane (interleave) address bits */
+	c->planes = features & 8 ? 1 << (p[113] & 0xf) : 1;
+	c->plane_program = 0x80;
+	c->plane_erase = 0xd1;
+	c->t_prog = le16(p + 133);
+	c->t_erase = le16(p + 135);
+	c->t_r = le16(p + 137);
+	if (!c->page_size || !c->pages_per_block || !c->num_blocks) return -1;
+	return 0;
+}
+
+/* Fill c from the five ID bytes, decoding the fourth and fifth as most
+   large-block parts use them.  The multi-plane opcodes aren't in the ID,
+   so the chip is driven one plane at a time.  Returns -1 if the bytes
+   don't make sense. */
+int chip_from_id(struct chip_type *c, const u8 *id) {
+	u32 block_bytes;
+	u64 plane_bytes;
+	int planes;
+
+	if (id[3] == 0x00 || id[3] == 0xff || id[4] == 0xff) return -1;
+	memset(c, 0, sizeof *c);
+	snprintf(c->name, sizeof c->name, "unknown %02x%02x", id[0], id[1]);
+	c->page_size = 1024 << (id[3] & 3);
+	c->spare_size = (8 << (id[3] >> 2 & 1)) * (c->page_size / 512);
+	block_bytes = (64 * 1024) << (id[3] >> 4 & 3);
+	c->pages_per_block = block_bytes / c->page_size;
+	planes = 1 << (id[4] >> 2 & 3);
+	plane_bytes = (8 * 1024 * 1024ULL) << (id[4] >> 4 & 7);	/* 64Mbit << n */
+	c->num_blocks = planes * plane_bytes / block_bytes;
+	c->planes = 1;
+	/* nothing to go on: allow for slow parts */
+	c->t_r = 100;
+	c->t_prog = 2000;
+	c->t_erase = 10000;
+	return 0;
+}
+
+void chip_print(const struct chip_type *c) {
+	printf("%d+%d byte pages, %d pages per block, %d blocks, %d plane%s\n",
+		c->page_size, c->spare_size, c->pages_per_block, c->num_blocks,
+		c->planes, c->planes > 1 ? "s" : "");
+	if (debug_mode)
+		printf("tR %dus, tPROG %dus, tBERS %dus, cache read %s, cache program %s\n",
+			c->t_r, c->t_prog, c->t_erase, c->cache_read ? "yes" : "no",
+			c->cache_program ? "yes" : "no");
+}
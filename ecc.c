@@ -1,77 +1,212 @@
 /*  Simple ECC verification code, originally by Segher */
 
+/*  The code is linear, so a 512-byte sector reduces to two things: the XOR
+    of all its bytes (which gives the three column bits and the overall
+    parity) and, for each of the nine bits of the byte index, the parity of
+    the bytes whose index has that bit set.  Both are computed a word or a
+    vector at a time; only the final fold looks at individual bytes. */
+
 #include <stdio.h>
 #include <string.h>
 #include "amoxiflash.h"
 
-static u8 parity(u8 x)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ECC_X86
+#include <immintrin.h>
+#endif
+
+/* parity_table[x] is the parity of x, generated by the preprocessor */
+#define P2(n) n, n ^ 1, n ^ 1, n
+#define P4(n) P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n) P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+static const u8 parity_table[256] = { P6(0), P6(1), P6(1), P6(0) };
+
+/* Fold the per-lane accumulators of a width-byte kernel into the ECC.
+   all[] is the XOR of every lane-sized chunk of the sector; hi[b] is the XOR
+   of the chunks whose chunk number has bit b set. */
+static void ecc_fold(const u8 *all, const u8 hi[][32], int width, u8 *ecc)
 {
-	u8 y = 0;
+	int shift, j, b, p;
+	u8 x, s;
+	u32 a0, a1;
+
+	for (shift = 0; (1 << shift) < width; shift++)
+		;
+
+	x = 0;
+	for (b = 0; b < width; b++) x ^= all[b];
+	p = parity_table[x];
 
-	while (x) {
-		y ^= (x & 1);
-		x >>= 1;
+	a0 = parity_table[x & 0x55] | parity_table[x & 0x33] << 1 | parity_table[x & 0x0f] << 2;
+	a1 = parity_table[x & 0xaa] | parity_table[x & 0xcc] << 1 | parity_table[x & 0xf0] << 2;
+
+	for (j = 0; j < 9; j++) {
+		s = 0;
+		if (j < shift) {
+			/* index bit j selects bytes within a chunk */
+			for (b = 0; b < width; b++)
+				if (b & (1 << j)) s ^= all[b];
+		} else {
+			for (b = 0; b < width; b++) s ^= hi[j - shift][b];
+		}
+		a1 |= parity_table[s] << (3 + j);
+		a0 |= (parity_table[s] ^ p) << (3 + j);
 	}
 
-	return y;
+	ecc[0] = a0;
+	ecc[1] = a0 >> 8;
+	ecc[2] = a1;
+	ecc[3] = a1 >> 8;
 }
 
-static void calc_ecc(u8 *data, u8 *ecc)
+static void calc_ecc_generic(const u8 *data, u8 *ecc)
 {
-	u8 a[12][2];
-	int i, j;
-	u32 a0, a1;
-	u8 x;
+	u64 w, all = 0, hi[6] = { 0 };
+	u8 hi_bytes[6][32];
+	int k, b;
 
-	memset(a, 0, sizeof a);
-	for (i = 0; i < 512; i++) {
-		x = data[i];
-		for (j = 0; j < 9; j++)
-			a[3+j][(i >> j) & 1] ^= x;
+	for (k = 0; k < 64; k++) {
+		memcpy(&w, data + 8 * k, 8);
+		all ^= w;
+		for (b = 0; b < 6; b++)
+			if (k & (1 << b)) hi[b] ^= w;
 	}
 
-	x = a[3][0] ^ a[3][1];
-	a[0][0] = x & 0x55;
-	a[0][1] = x & 0xaa;
-	a[1][0] = x & 0x33;
-	a[1][1] = x & 0xcc;
-	a[2][0] = x & 0x0f;
-	a[2][1] = x & 0xf0;
-
-	for (j = 0; j < 12; j++) {
-		a[j][0] = parity(a[j][0]);
-		a[j][1] = parity(a[j][1]);
+	for (b = 0; b < 6; b++) memcpy(hi_bytes[b], &hi[b], 8);
+	ecc_fold((u8 *)&all, (const u8 (*)[32])hi_bytes, 8, ecc);
+}
+
+#ifdef ECC_X86
+__attribute__((target("sse2")))
+static void calc_ecc_sse2(const u8 *data, u8 *ecc)
+{
+	__m128i w, all = _mm_setzero_si128();
+	__m128i hi[5];
+	u8 all_bytes[16], hi_bytes[5][32];
+	int k, b;
+
+	for (b = 0; b < 5; b++) hi[b] = _mm_setzero_si128();
+	for (k = 0; k < 32; k++) {
+		w = _mm_loadu_si128((const __m128i *)(data + 16 * k));
+		all = _mm_xor_si128(all, w);
+		for (b = 0; b < 5; b++)
+			if (k & (1 << b)) hi[b] = _mm_xor_si128(hi[b], w);
 	}
 
-	a0 = a1 = 0;
-	for (j = 0; j < 12; j++) {
-		a0 |= a[j][0] << j;
-		a1 |= a[j][1] << j;
+	_mm_storeu_si128((__m128i *)all_bytes, all);
+	for (b = 0; b < 5; b++) _mm_storeu_si128((__m128i *)hi_bytes[b], hi[b]);
+	ecc_fold(all_bytes, (const u8 (*)[32])hi_bytes, 16, ecc);
+}
+
+__attribute__((target("avx2")))
+static void calc_ecc_avx2(const u8 *data, u8 *ecc)
+{
+	__m256i w, all = _mm256_setzero_si256();
+	__m256i hi[4];
+	u8 all_bytes[16], hi_bytes[5][32];
+	int k, b;
+
+	for (b = 0; b < 4; b++) hi[b] = _mm256_setzero_si256();
+	for (k = 0; k < 16; k++) {
+		w = _mm256_loadu_si256((const __m256i *)(data + 32 * k));
+		all = _mm256_xor_si256(all, w);
+		for (b = 0; b < 4; b++)
+			if (k & (1 << b)) hi[b] = _mm256_xor_si256(hi[b], w);
 	}
 
-	ecc[0] = a0;
-	ecc[1] = a0 >> 8;
-	ecc[2] = a1;
-	ecc[3] = a1 >> 8;
+	/* Narrow to the 16-byte layout: the upper half of all becomes the
+	   accumulator for index bit 4, and only the XOR of each hi[] matters */
+	_mm_storeu_si128((__m128i *)all_bytes,
+		_mm_xor_si128(_mm256_castsi256_si128(all), _mm256_extracti128_si256(all, 1)));
+	_mm_storeu_si128((__m128i *)hi_bytes[0], _mm256_extracti128_si256(all, 1));
+	for (b = 0; b < 4; b++)
+		_mm_storeu_si128((__m128i *)hi_bytes[b + 1],
+			_mm_xor_si128(_mm256_castsi256_si128(hi[b]), _mm256_extracti128_si256(hi[b], 1)));
+	ecc_fold(all_bytes, (const u8 (*)[32])hi_bytes, 16, ecc);
 }
+#endif
+
+static void (*calc_ecc)(const u8 *data, u8 *ecc) = calc_ecc_generic;
+static const char *ecc_impl = "generic";
 
-u8 * calc_page_ecc(u8 *data)
+/* Pick the widest kernel the CPU supports, once, before main() runs */
+__attribute__((constructor))
+static void ecc_select(void)
 {
-	static u8 ecc[16];
+#ifdef ECC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		calc_ecc = calc_ecc_avx2;
+		ecc_impl = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		calc_ecc = calc_ecc_sse2;
+		ecc_impl = "sse2";
+	}
+#endif
+}
+
+const char *ecc_implementation(void)
+{
+	return ecc_impl;
+}
+
+/* Compute the ECC bytes of a page into ecc, 4 per sector (16 for a
+   2048-byte page) */
+void calc_page_ecc(const u8 *data, u8 *ecc)
+{
+	int i;
+	for (i = 0; i < ECC_SECTORS; i++)
+		calc_ecc(data + 512 * i, ecc + 4 * i);
+}
+
+
+/* Compare one 512-byte sector against its four stored ECC bytes and repair
+   a single flipped bit.  A flipped data bit changes every bit of a0 and a1
+   in opposite senses, and the a1 syndrome is then the bit's position (byte
+   index << 3 | bit).  A syndrome of a single bit means the stored ECC took
+   the hit instead.  Returns 0 if clean, 1 if repaired, -1 if not repairable. */
+int correct_sector(u8 *data, u8 *stored)
+{
+	u8 ecc[4];
+	u32 s0, s1, s;
 
 	calc_ecc(data, ecc);
-	calc_ecc(data + 512, ecc + 4);
-	calc_ecc(data + 1024, ecc + 8);
-	calc_ecc(data + 1536, ecc + 12);
-	return ecc;
+	s0 = (ecc[0] | ecc[1] << 8) ^ (stored[0] | stored[1] << 8);
+	s1 = (ecc[2] | ecc[3] << 8) ^ (stored[2] | stored[3] << 8);
+	if (!s0 && !s1) return 0;
+
+	if ((s0 ^ s1) == 0xfff) {
+		data[s1 >> 3] ^= 1 << (s1 & 7);
+		return 1;
+	}
+	s = s0 | s1 << 16;
+	if (!(s & (s - 1))) {
+		memcpy(stored, ecc, 4);
+		return 1;
+	}
+	return -1;
 }
 
+/* Repair single-bit errors in a page whose ECC is WRONG, one per sector.
+   Returns the number of sectors repaired, or -1 if any is beyond repair. */
+int correct_page_ecc(u8 *page)
+{
+	int i, r, fixed = 0;
+	for (i = 0; i < ECC_SECTORS; i++) {
+		r = correct_sector(page + 512 * i, page + ECC_OFFSET + 4 * i);
+		if (r < 0) return -1;
+		fixed += r;
+	}
+	return fixed;
+}
 
 int check_ecc(u8 *page) {
-	u8 *stored_ecc = page + 2048 + 48;
-	if (page[2048]!=0xFF) return ECC_INVALID;
+	u8 *stored_ecc = page + ECC_OFFSET;
+	u8 ecc[4 * ECC_SECTORS_MAX];
+	if (page[page_size]!=0xFF) return ECC_INVALID;
 	if (stored_ecc[0] == 0xFF && stored_ecc[1] == 0xFF) return ECC_BLANK;
-	
-	if (memcmp(stored_ecc, calc_page_ecc(page), 16)) return ECC_WRONG;
+
+	calc_page_ecc(page, ecc);
+	if (memcmp(stored_ecc, ecc, 4 * ECC_SECTORS)) return ECC_WRONG;
 	return ECC_OK;
 }
@@ -0,0 +1,202 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Gang mode: run the same command on several programmers at once.
+
+   Everything else in amoxiflash drives exactly one device through global
+   state, so each programmer gets its own process.  gang_start() forks one
+   child per target and returns the target's index in the child, which then
+   carries on as a normal single-device run with its output sent down a
+   pipe.  The parent never returns: it shows each device's log lines and
+   latest progress, and prints a summary once every child has exited. */
+
+#ifndef __MINGW32__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include "amoxiflash.h"
+
+#define GANG_PROGRESS_FIELD 20
+
+struct gang_member {
+	const char *name;
+	pid_t pid;
+	int fd;
+	char line[256];
+	int linelen;
+	char progress[2 * GANG_PROGRESS_FIELD + 2];
+	char last[256];		/* last complete output line */
+	int status;
+	time_t start, end;
+};
+
+static struct gang_member *members;
+static int num_members;
+
+/* Keep the block number and the trailing "xx.x% Nm" of a progress line */
+static void gang_set_progress(struct gang_member *m) {
+	char *first, *tail;
+	int n;
+
+	m->line[m->linelen] = 0;
+	for (first = m->line; *first == ' '; first++)
+		;
+	if (!*first) return;
+
+	/* a block number or two; anything longer isn't one */
+	n = strcspn(first, " .=x!F");
+	if (n > GANG_PROGRESS_FIELD) n = GANG_PROGRESS_FIELD;
+	tail = strrchr(first, '%');
+	if (tail) {
+		/* "NN.N%": back over the digits, the point and the digits */
+		while (tail > first && isdigit((unsigned char)tail[-1])) tail--;
+		if (tail > first && tail[-1] == '.') tail--;
+		while (tail > first && isdigit((unsigned char)tail[-1])) tail--;
+		snprintf(m->progress, sizeof m->progress, "%.*s %.*s", n, first, GANG_PROGRESS_FIELD, tail);
+	} else {
+		snprintf(m->progress, sizeof m->progress, "%.*s", n, first);
+	}
+}
+
+static void gang_draw_status(void) {
+	int i;
+	printf("\r");
+	for (i = 0; i < num_members; i++) {
+		if (members[i].pid)
+			printf("[%s %s] ", members[i].name, members[i].progress);
+		else
+			printf("[%s done] ", members[i].name);
+	}
+	fflush(stdout);
+}
+
+static void gang_output(struct gang_member *m, char *buf, int len) {
+	int i;
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\n') {
+			m->line[m->linelen] = 0;
+			if (m->linelen) {
+				printf("\r%-79s\r[%s] %s\n", "", m->name, m->line);
+				snprintf(m->last, sizeof m->last, "%s", m->line);
+			}
+			m->linelen = 0;
+		} else if (buf[i] == '\r') {
+			gang_set_progress(m);
+			m->linelen = 0;
+		} else if (m->linelen < sizeof m->line - 1) {
+			m->line[m->linelen++] = buf[i];
+		}
+	}
+}
+
+/* Fork one child per target.  Returns the child's target index; the parent
+   exits once all children have finished. */
+int gang_start(int n, char **names) {
+	struct pollfd *fds;
+	int i, j, fd[2], running, worst = 0;
+	char buf[4096];
+	ssize_t len;
+
+	members = calloc(n, sizeof *members);
+	fds = calloc(n, sizeof *fds);
+	num_members = n;
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < n; i++) {
+		members[i].name = names[i];
+		if (pipe(fd) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+		members[i].start = time(NULL);
+		members[i].pid = fork();
+		if (members[i].pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (members[i].pid == 0) {
+			for (j = 0; j < i; j++) close(members[j].fd);
+			close(fd[0]);
+			dup2(fd[1], 1);
+			dup2(fd[1], 2);
+			close(fd[1]);
+			free(fds);
+			return i;
+		}
+		close(fd[1]);
+		members[i].fd = fd[0];
+	}
+
+	printf("Running on %d devices\n", n);
+	for (running = n; running; ) {
+		for (i = 0; i < n; i++) {
+			fds[i].fd = members[i].pid ? members[i].fd : -1;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		if (poll(fds, n, 1000) < 0) continue;
+		for (i = 0; i < n; i++) {
+			if (!fds[i].revents) continue;
+			len = read(members[i].fd, buf, sizeof buf);
+			if (len > 0) {
+				gang_output(&members[i], buf, len);
+				continue;
+			}
+			/* EOF: the child has gone */
+			close(members[i].fd);
+			waitpid(members[i].pid, &members[i].status, 0);
+			members[i].pid = 0;
+			members[i].end = time(NULL);
+			running--;
+		}
+		gang_draw_status();
+	}
+
+	printf("\n\n%-16s %-8s %6s  %s\n", "Device", "Result", "Time", "Last message");
+	for (i = 0; i < n; i++) {
+		struct gang_member *m = &members[i];
+		int ok = WIFEXITED(m->status) && WEXITSTATUS(m->status) == 0;
+		char result[16];
+		if (ok) strcpy(result, "OK");
+		else if (WIFEXITED(m->status)) sprintf(result, "exit %d", WEXITSTATUS(m->status));
+		else strcpy(result, "killed");
+		if (!ok) worst = 1;
+		printf("%-16s %-8s %5lds  %s\n", m->name, result, (long)(m->end - m->start), m->last);
+	}
+	exit(worst);
+}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "amoxiflash.h"
+
+int gang_start(int n, char **names) {
+	fprintf(stderr, "Driving several devices at once is not supported on this platform\n");
+	exit(1);
+}
+
+#endif
@@ -0,0 +1,729 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Dump file access.  Images are mapped into memory and pages are handed out
+   as pointers into the mapping, so walking an image costs no system calls
+   per page.  Where mmap is unavailable the whole file is read into memory
+   instead (and written back on close for output images).
+
+   A sparse image leaves out the pages that are all FF, which in a console
+   dump is a good part of the chip.  After the header comes a bitmap of the
+   pages that are stored, then the file offset of each block's stored
+   pages, which follow one another in page order.  A blank page reads as a
+   shared page of FF.  Sparse images are written a block at a time: the
+   block being written is held in memory and stored when another block is
+   touched.  A block written to again later is stored afresh at the end of
+   the file.
+
+   A compressed image (-F zlib) is a sparse image whose blocks are each
+   deflated into a frame of their own, with a second table giving each
+   frame's length, so any block can be got at without the ones before it.
+   Frames are made as blocks are stored, which in a dump is on the writer
+   thread, off the USB path.  Reading decodes a block the first time one of
+   its pages is asked for and keeps it until image_release() lets it go.
+
+   While a sparse image is written, the file's copy of the bitmap and
+   tables is kept up to date block by block, so that a dump cut short can
+   be taken up again with image_reopen(); only the header waits for the
+   end. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "amoxiflash.h"
+
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#define IMAGE_MMAP
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define SPARSE_MAGIC "AMXSPARS"
+
+/* guards the decoded blocks of compressed images */
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct image *image_alloc(const char *filename, int fd, u64 size, int writable) {
+	struct image *img = calloc(1, sizeof *img);
+	img->fd = fd;
+	img->size = size;
+	img->num_pages = size / (page_size + spare_size);
+	img->writable = writable;
+	img->filename = strdup(filename);
+	img->block_cur = -1;
+	return img;
+}
+
+static int sparse_bitmap_size(u64 num_pages) {
+	return ((num_pages + 7) / 8 + 7) & ~7;
+}
+
+/* The bitmap and the block table, and for a compressed image the frame
+   lengths */
+static u64 sparse_tables_size(u64 num_pages, u64 num_blocks, int format) {
+	u64 size = sparse_bitmap_size(num_pages) + num_blocks * 8;
+	if (format == IMAGE_ZLIB) size += (num_blocks * 4 + 7) & ~7;
+	return size;
+}
+
+static int sparse_stored(struct image *img, u32 pageno) {
+	return img->bitmap[pageno / 8] >> (pageno % 8) & 1;
+}
+
+static int sparse_block_pages(struct image *img, u32 blockno) {
+	u32 p = blockno * pages_per_block;
+	int n = 0;
+	for (; p < (blockno + 1) * pages_per_block && p < img->num_pages; p++)
+		n += sparse_stored(img, p);
+	return n;
+}
+
+/* Where a stored page is: after the stored pages before it in its block */
+static u64 sparse_offset(struct image *img, u32 pageno) {
+	u32 p = pageno - pageno % pages_per_block;
+	u64 offset = img->block_offset[pageno / pages_per_block];
+	for (; p < pageno; p++)
+		if (sparse_stored(img, p)) offset += page_size + spare_size;
+	return offset;
+}
+
+static void sparse_alloc_buffers(struct image *img) {
+	int page_len = page_size + spare_size;
+	img->blank = malloc(page_len);
+	memset(img->blank, 0xff, page_len);
+	img->block_buf = malloc(pages_per_block * page_len);
+	img->pack_buf = malloc(pages_per_block * page_len);
+	if (img->format == IMAGE_ZLIB) {
+		img->frame_buf = malloc(compressBound(pages_per_block * page_len));
+		if (!img->writable) img->decoded = calloc(img->num_blocks, sizeof *img->decoded);
+	}
+}
+
+/* Take on a sparse image read by image_open().  -1 if it isn't one this
+   geometry can use. */
+static int sparse_open(struct image *img) {
+	struct sparse_header *hdr = (struct sparse_header *)img->map;
+	u32 compression = 0;
+	u64 b, last, end;
+
+	if (img->map_size >= sizeof *hdr && hdr->version >= 2 && hdr->header_size >= sizeof *hdr)
+		compression = hdr->compression;
+	img->format = compression ? IMAGE_ZLIB : IMAGE_SPARSE;
+	if (img->map_size < SPARSE_V1_HEADER || hdr->version < 1 || hdr->version > SPARSE_VERSION ||
+	    compression > SPARSE_ZLIB || hdr->data_offset > img->map_size ||
+	    hdr->data_offset < hdr->header_size +
+	                       sparse_tables_size(hdr->num_pages, hdr->num_blocks, img->format)) {
+		fprintf(stderr, "%s: not a sparse image this version can read\n", img->filename);
+		return -1;
+	}
+	if (hdr->page_len != page_size + spare_size || hdr->pages_per_block != pages_per_block) {
+		fprintf(stderr, "%s: sparse image of %u-byte pages, %u to a block; this chip has %d, %d\n",
+			img->filename, hdr->page_len, hdr->pages_per_block,
+			page_size + spare_size, pages_per_block);
+		return -1;
+	}
+	img->num_pages = hdr->num_pages;
+	img->num_blocks = hdr->num_blocks;
+	img->size = hdr->num_pages * hdr->page_len;
+	img->bitmap = img->map + hdr->header_size;
+	img->block_offset = (u64 *)(img->bitmap + sparse_bitmap_size(hdr->num_pages));
+	if (img->format == IMAGE_ZLIB) img->block_length = (u32 *)(img->block_offset + img->num_blocks);
+	/* every stored page must be in the file */
+	for (b = 0; b < img->num_blocks; b++) {
+		if (!img->block_offset[b]) continue;
+		if (img->format == IMAGE_ZLIB) {
+			end = img->block_offset[b] + img->block_length[b];
+		} else {
+			last = (b + 1) * pages_per_block - 1;
+			if (last >= img->num_pages) last = img->num_pages - 1;
+			end = sparse_offset(img, last) + sparse_stored(img, last) * hdr->page_len;
+		}
+		if (img->block_offset[b] < hdr->data_offset || end > img->map_size) {
+			fprintf(stderr, "%s: sparse image is cut short\n", img->filename);
+			return -1;
+		}
+	}
+	sparse_alloc_buffers(img);
+	return 0;
+}
+
+/* Map an existing image read-only, hinting that it will be read front to
+   back.  Returns NULL (with errno set) if the file can't be opened. */
+struct image *image_open(const char *filename) {
+	struct image *img;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	img = image_alloc(filename, fd, st.st_size, 0);
+	img->map_size = st.st_size;
+	if (!img->size) return img;
+
+#ifdef IMAGE_MMAP
+	img->map = mmap(NULL, img->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (img->map == MAP_FAILED) {
+		int err = errno;
+		img->map = NULL;
+		image_close(img);
+		errno = err;
+		return NULL;
+	}
+	madvise(img->map, img->map_size, MADV_SEQUENTIAL);
+#else
+	img->map = malloc(img->map_size);
+	if (!img->map || read(fd, img->map, img->map_size) != img->map_size) {
+		image_close(img);
+		errno = EIO;
+		return NULL;
+	}
+#endif
+	if (img->map_size >= 8 && !memcmp(img->map, SPARSE_MAGIC, 8) && sparse_open(img) < 0) {
+		image_close(img);
+		errno = EINVAL;
+		return NULL;
+	}
+	return img;
+}
+
+/* Create (or truncate) an image of exactly size bytes and map it for
+   writing.  The space is reserved up front so writes into the mapping
+   can't fail for lack of disk. */
+struct image *image_create(const char *filename, u64 size) {
+	struct image *img;
+	int fd, err;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd < 0) return NULL;
+	img = image_alloc(filename, fd, size, 1);
+	img->map_size = size;
+	if (!size) return img;
+
+#ifdef IMAGE_MMAP
+	/* a filesystem that can't preallocate gets a sparse file; anything
+	   else (a full disk) would only turn up as SIGBUS halfway through */
+	err = posix_fallocate(fd, 0, size);
+	if (err == EOPNOTSUPP || err == EINVAL)
+		err = ftruncate(fd, size) < 0 ? errno : 0;
+	if (err) {
+		image_close(img);
+		errno = err;
+		return NULL;
+	}
+	img->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (img->map == MAP_FAILED) {
+		err = errno;
+		img->map = NULL;
+		image_close(img);
+		errno = err;
+		return NULL;
+	}
+	madvise(img->map, size, MADV_SEQUENTIAL);
+#else
+	img->map = malloc(size);
+	if (!img->map) {
+		image_close(img);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(img->map, 0xff, size);
+#endif
+	return img;
+}
+
+/* The in-memory side of a sparse image being written to fd */
+static struct image *image_create_sparse_fd(const char *filename, int fd, u64 num_pages, int format) {
+	struct image *img = image_alloc(filename, fd, num_pages * (page_size + spare_size), 1);
+	img->format = format;
+	img->num_blocks = (num_pages + pages_per_block - 1) / pages_per_block;
+	img->bitmap = calloc(sparse_bitmap_size(num_pages), 1);
+	img->block_offset = calloc(img->num_blocks, sizeof *img->block_offset);
+	if (format == IMAGE_ZLIB) img->block_length = calloc(img->num_blocks, sizeof *img->block_length);
+	img->data_end = sizeof(struct sparse_header) + sparse_tables_size(num_pages, img->num_blocks, format);
+	sparse_alloc_buffers(img);
+	return img;
+}
+
+/* Create a sparse image of num_pages pages, compressed if format is
+   IMAGE_ZLIB.  Its header is written by image_close(); until then the file
+   doesn't read as an image at all. */
+struct image *image_create_sparse(const char *filename, u64 num_pages, int format) {
+	struct image *img;
+	int fd, err;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd < 0) return NULL;
+	img = image_create_sparse_fd(filename, fd, num_pages, format);
+	/* room for the tables from the start, however few blocks get stored */
+	if (ftruncate(fd, img->data_end) < 0) {
+		err = errno;
+		img->writable = 0;
+		image_close(img);
+		errno = err;
+		return NULL;
+	}
+	return img;
+}
+
+/* Open an image left unfinished by an interrupted dump, to carry on
+   writing it: a raw image of num_pages pages, or a sparse one whose
+   bitmap and tables are read back from the file.  A block whose data
+   didn't all reach the file is taken as not written.  NULL (with errno
+   set) if there is no such image. */
+struct image *image_reopen(const char *filename, u64 num_pages, int format) {
+	struct image *img;
+	struct stat st;
+	u64 size = num_pages * (page_size + spare_size), at, b, end;
+	u32 first, p;
+	int fd;
+
+	fd = open(filename, O_RDWR | O_BINARY);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (format == IMAGE_RAW) {
+		if (st.st_size != size) {
+			close(fd);
+			errno = EINVAL;
+			return NULL;
+		}
+		img = image_alloc(filename, fd, size, 1);
+		img->map_size = size;
+		if (!size) return img;
+#ifdef IMAGE_MMAP
+		img->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (img->map == MAP_FAILED) img->map = NULL;
+		else madvise(img->map, size, MADV_SEQUENTIAL);
+#else
+		img->map = malloc(size);
+		if (img->map && read(fd, img->map, size) != size) {
+			free(img->map);
+			img->map = NULL;
+		}
+#endif
+		if (!img->map) {
+			image_close(img);
+			errno = EIO;
+			return NULL;
+		}
+		return img;
+	}
+
+	img = image_create_sparse_fd(filename, fd, num_pages, format);
+	at = sizeof(struct sparse_header);
+	if (st.st_size < img->data_end ||
+	    lseek(fd, at, SEEK_SET) == (off_t)-1 ||
+	    read(fd, img->bitmap, sparse_bitmap_size(num_pages)) != sparse_bitmap_size(num_pages) ||
+	    read(fd, img->block_offset, img->num_blocks * 8) != img->num_blocks * 8 ||
+	    (img->block_length &&
+	     read(fd, img->block_length, img->num_blocks * 4) != img->num_blocks * 4)) {
+		/* not ours to finish */
+		img->writable = 0;
+		image_close(img);
+		errno = EINVAL;
+		return NULL;
+	}
+	for (b = 0; b < img->num_blocks; b++) {
+		if (!img->block_offset[b]) continue;
+		end = img->block_offset[b] + (img->block_length ? img->block_length[b] :
+			(u64)sparse_block_pages(img, b) * (page_size + spare_size));
+		if (img->block_offset[b] >= img->data_end && end <= st.st_size) continue;
+		img->block_offset[b] = 0;
+		first = b * pages_per_block;
+		for (p = first; p < first + pages_per_block && p < num_pages; p++)
+			img->bitmap[p / 8] &= ~(1 << (p % 8));
+	}
+	img->data_end = st.st_size;
+	return img;
+}
+
+static int sparse_write(struct image *img, const void *buf, u64 len, u64 offset) {
+	if (lseek(img->fd, offset, SEEK_SET) == (off_t)-1 || write(img->fd, buf, len) != len) {
+		perror(img->filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* Update the file's copy of block blockno's bitmap bits and table entries */
+static int sparse_store_entry(struct image *img, u32 blockno) {
+	u64 bitmap_at = sizeof(struct sparse_header), offset_at, length_at;
+	u64 first = (u64)blockno * pages_per_block / 8;
+	u64 end = ((u64)(blockno + 1) * pages_per_block + 7) / 8;
+
+	offset_at = bitmap_at + sparse_bitmap_size(img->num_pages);
+	length_at = offset_at + img->num_blocks * 8;
+	if (end > (img->num_pages + 7) / 8) end = (img->num_pages + 7) / 8;
+	if (sparse_write(img, img->bitmap + first, end - first, bitmap_at + first) < 0 ||
+	    sparse_write(img, &img->block_offset[blockno], 8, offset_at + blockno * 8ULL) < 0)
+		return -1;
+	if (img->block_length &&
+	    sparse_write(img, &img->block_length[blockno], 4, length_at + blockno * 4ULL) < 0)
+		return -1;
+	return 0;
+}
+
+static int sparse_read(struct image *img, void *buf, u64 len, u64 offset) {
+	if (lseek(img->fd, offset, SEEK_SET) == (off_t)-1 || read(img->fd, buf, len) != len) {
+		perror(img->filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* Spread the stored pages of block blockno, packed at the start of buf,
+   out to their places, filling in the blank pages */
+static void sparse_unpack(struct image *img, u32 blockno, u8 *buf, int stored) {
+	int page_len = page_size + spare_size, i;
+	u32 first = blockno * pages_per_block;
+
+	for (i = pages_per_block - 1; i >= 0; i--) {
+		u8 *dst = buf + i * page_len;
+		if (first + i < img->num_pages && sparse_stored(img, first + i))
+			memmove(dst, buf + --stored * page_len, page_len);
+		else
+			memset(dst, 0xff, page_len);
+	}
+}
+
+/* Decode block blockno of a compressed image from its frame into buf.  A
+   frame that doesn't decode is fatal: the image is damaged. */
+static void zlib_decode(struct image *img, u32 blockno, const u8 *frame, u8 *buf) {
+	int stored = sparse_block_pages(img, blockno);
+	uLongf len = pages_per_block * (page_size + spare_size);
+
+	if (uncompress(buf, &len, frame, img->block_length[blockno]) != Z_OK ||
+	    len != (uLongf)stored * (page_size + spare_size)) {
+		fprintf(stderr, "%s: block %04x is damaged\n", img->filename, blockno);
+		exit(1);
+	}
+	sparse_unpack(img, blockno, buf, stored);
+}
+
+/* Block blockno of a compressed image being read.  It is decoded once and
+   kept until image_release() covers it, so pointers into it are good for
+   every thread until then. */
+static u8 *zlib_block(struct image *img, u32 blockno) {
+	u8 *buf;
+
+	pthread_mutex_lock(&decode_lock);
+	buf = img->decoded[blockno];
+	pthread_mutex_unlock(&decode_lock);
+	if (buf) return buf;
+
+	buf = malloc(pages_per_block * (page_size + spare_size));
+	if (img->block_offset[blockno])
+		zlib_decode(img, blockno, img->map + img->block_offset[blockno], buf);
+	else
+		memset(buf, 0xff, pages_per_block * (page_size + spare_size));
+
+	/* another thread may have got there first */
+	pthread_mutex_lock(&decode_lock);
+	if (img->decoded[blockno]) {
+		free(buf);
+		buf = img->decoded[blockno];
+	} else {
+		img->decoded[blockno] = buf;
+	}
+	pthread_mutex_unlock(&decode_lock);
+	return buf;
+}
+
+/* Store the block being written: its pages that aren't blank, deflated if
+   the image is compressed, in place if they still fit, else at the end of
+   the file */
+static int sparse_flush(struct image *img) {
+	int page_len = page_size + spare_size, i, stored = 0, had = 0;
+	uLongf len;
+	u32 first;
+	u8 *page, *data;
+	u64 *offset;
+
+	if (img->block_cur < 0 || !img->block_dirty) return 0;
+	first = img->block_cur * pages_per_block;
+	for (i = 0; i < pages_per_block && first + i < img->num_pages; i++) {
+		page = img->block_buf + i * page_len;
+		had += sparse_stored(img, first + i);
+		if (flash_isFF(page, page_len)) {
+			img->bitmap[(first + i) / 8] &= ~(1 << ((first + i) % 8));
+			continue;
+		}
+		img->bitmap[(first + i) / 8] |= 1 << ((first + i) % 8);
+		memcpy(img->pack_buf + stored++ * page_len, page, page_len);
+	}
+	img->block_dirty = 0;
+	offset = &img->block_offset[img->block_cur];
+	if (!stored) {
+		*offset = 0;
+		if (img->block_length) img->block_length[img->block_cur] = 0;
+		return sparse_store_entry(img, img->block_cur);
+	}
+	data = img->pack_buf;
+	len = (uLongf)stored * page_len;
+	if (img->format == IMAGE_ZLIB) {
+		data = img->frame_buf;
+		len = compressBound(pages_per_block * page_len);
+		if (compress2(data, &len, img->pack_buf, (uLongf)stored * page_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			fprintf(stderr, "%s: couldn't compress block %04x\n", img->filename, img->block_cur);
+			return -1;
+		}
+		/* measure "still fits" in bytes rather than pages */
+		stored = len;
+		had = *offset ? img->block_length[img->block_cur] : 0;
+		img->block_length[img->block_cur] = len;
+	}
+	if (!*offset || stored > had) {
+		*offset = img->data_end;
+		img->data_end += len;
+	}
+	if (sparse_write(img, data, len, *offset) < 0) return -1;
+	return sparse_store_entry(img, img->block_cur);
+}
+
+/* Make blockno the block in block_buf, with blank pages filled in */
+static int sparse_load(struct image *img, u32 blockno) {
+	int page_len = page_size + spare_size, stored;
+	u64 offset, len;
+
+	if (img->block_cur == blockno) return 0;
+	if (img->writable && sparse_flush(img) < 0) return -1;
+	img->block_cur = -1;
+	offset = img->block_offset[blockno];
+	stored = offset ? sparse_block_pages(img, blockno) : 0;
+	if (img->format == IMAGE_ZLIB && stored) {
+		len = img->block_length[blockno];
+		if (img->writable && sparse_read(img, img->frame_buf, len, offset) < 0) return -1;
+		zlib_decode(img, blockno, img->writable ? img->frame_buf : img->map + offset, img->block_buf);
+	} else {
+		len = (u64)stored * page_len;
+		if (img->writable) {
+			if (stored && sparse_read(img, img->block_buf, len, offset) < 0) return -1;
+		} else {
+			memcpy(img->block_buf, img->map + offset, len);
+		}
+		sparse_unpack(img, blockno, img->block_buf, stored);
+	}
+	img->block_cur = blockno;
+	return 0;
+}
+
+/* Pointer to page pageno, or NULL if the image doesn't hold all of it.  For
+   a sparse image being written it is only good until another block is
+   touched. */
+u8 *image_page(struct image *img, u32 pageno) {
+	if (pageno >= img->num_pages) return NULL;
+	if (img->format != IMAGE_RAW) {
+		if (img->writable) {
+			if (sparse_load(img, pageno / pages_per_block) < 0) return NULL;
+			return img->block_buf + (pageno % pages_per_block) * (page_size + spare_size);
+		}
+		if (!sparse_stored(img, pageno)) return img->blank;
+		if (img->format == IMAGE_ZLIB)
+			return zlib_block(img, pageno / pages_per_block) +
+				(pageno % pages_per_block) * (page_size + spare_size);
+		return img->map + sparse_offset(img, pageno);
+	}
+	return img->map + (u64)pageno * (page_size + spare_size);
+}
+
+/* Pointer to the first page of block blockno, or NULL if the image doesn't
+   hold the whole block.  A sparse image's block is put together in a
+   buffer, which the next call reuses. */
+u8 *image_block(struct image *img, u32 blockno) {
+	if ((u64)(blockno + 1) * pages_per_block > img->num_pages) return NULL;
+	if (img->format == IMAGE_ZLIB && !img->writable) return zlib_block(img, blockno);
+	if (img->format != IMAGE_RAW) {
+		if (sparse_load(img, blockno) < 0) return NULL;
+		return img->block_buf;
+	}
+	return image_page(img, blockno * pages_per_block);
+}
+
+/* Write page pageno; -1 if it is past the end or the write fails */
+int image_write_page(struct image *img, u32 pageno, const u8 *src) {
+	u8 *dst = image_page(img, pageno);
+	if (!dst) return -1;
+	memcpy(dst, src, page_size + spare_size);
+	if (img->format != IMAGE_RAW) img->block_dirty = 1;
+	return 0;
+}
+
+/* Make sure block blockno of an image being written has reached the disk,
+   for dump's journal.  -1 if it can't be. */
+int image_sync(struct image *img, u32 blockno) {
+	u64 len = (u64)pages_per_block * (page_size + spare_size), start = blockno * len;
+#ifdef IMAGE_MMAP
+	long pagesz = sysconf(_SC_PAGESIZE);
+#endif
+
+	if (img->format != IMAGE_RAW) {
+		if (img->block_cur == blockno && sparse_flush(img) < 0) return -1;
+		return fsync(img->fd);
+	}
+	if (!img->map || start >= img->size) return 0;
+	if (start + len > img->size) len = img->size - start;
+#ifdef IMAGE_MMAP
+	len += start % pagesz;
+	start -= start % pagesz;
+	return msync(img->map + start, len, MS_SYNC);
+#else
+	if (sparse_write(img, img->map + start, len, start) < 0) return -1;
+	return fsync(img->fd);
+#endif
+}
+
+/* Tell the kernel that a range of pages is done with, so a long sequential
+   pass doesn't push everything else out of the page cache.  A sparse image
+   being written stores its block if it is in the range; a compressed one
+   being read frees the blocks it decoded there. */
+void image_release(struct image *img, u32 first_page, u32 count) {
+	u32 b;
+#ifdef IMAGE_MMAP
+	long pagesz = sysconf(_SC_PAGESIZE);
+	u64 start, end;
+	u32 last;
+#endif
+
+	if (img->format != IMAGE_RAW && img->writable) {
+		if (img->block_cur >= 0 && img->block_cur * pages_per_block >= first_page &&
+		    img->block_cur * pages_per_block < first_page + count)
+			sparse_flush(img);
+		return;
+	}
+	if (img->format == IMAGE_ZLIB) {
+		pthread_mutex_lock(&decode_lock);
+		for (b = first_page / pages_per_block; b < img->num_blocks &&
+		     b * pages_per_block < first_page + count; b++) {
+			free(img->decoded[b]);
+			img->decoded[b] = NULL;
+		}
+		pthread_mutex_unlock(&decode_lock);
+	}
+#ifdef IMAGE_MMAP
+	if (!img->map) return;
+	if (img->format != IMAGE_RAW) {
+		for (b = first_page / pages_per_block; b < img->num_blocks &&
+		     b * pages_per_block < first_page + count; b++) {
+			if (!img->block_offset[b]) continue;
+			start = img->block_offset[b];
+			if (img->format == IMAGE_ZLIB) {
+				end = start + img->block_length[b];
+			} else {
+				last = (b + 1) * pages_per_block - 1;
+				if (last >= img->num_pages) last = img->num_pages - 1;
+				end = sparse_offset(img, last) + page_size + spare_size;
+			}
+			start -= start % pagesz;
+			if (end > img->map_size) end = img->map_size;
+			if (end > start) madvise(img->map + start, end - start, MADV_DONTNEED);
+		}
+		return;
+	}
+	start = (u64)first_page * (page_size + spare_size);
+	end = start + (u64)count * (page_size + spare_size);
+	start -= start % pagesz;
+	if (end > img->size) end = img->size;
+	if (end <= start) return;
+	if (img->writable) msync(img->map + start, end - start, MS_ASYNC);
+	madvise(img->map + start, end - start, MADV_DONTNEED);
+#endif
+}
+
+/* Finish a sparse image being written: the tables, then the header, whose
+   magic makes the file an image */
+static void sparse_finish(struct image *img) {
+	struct sparse_header hdr;
+	u64 present = 0, p, offset;
+
+	if (sparse_flush(img) < 0) return;
+	for (p = 0; p < img->num_pages; p++) present += sparse_stored(img, p);
+	memset(&hdr, 0, sizeof hdr);
+	hdr.version = SPARSE_VERSION;
+	hdr.header_size = sizeof hdr;
+	hdr.page_len = page_size + spare_size;
+	hdr.pages_per_block = pages_per_block;
+	hdr.num_pages = img->num_pages;
+	hdr.num_blocks = img->num_blocks;
+	hdr.present = present;
+	hdr.data_offset = sizeof hdr + sparse_tables_size(img->num_pages, img->num_blocks, img->format);
+	hdr.compression = img->format == IMAGE_ZLIB ? SPARSE_ZLIB : 0;
+	offset = sizeof hdr + sparse_bitmap_size(img->num_pages);
+	if (sparse_write(img, img->bitmap, sparse_bitmap_size(img->num_pages), sizeof hdr) < 0 ||
+	    sparse_write(img, img->block_offset, img->num_blocks * 8, offset) < 0 ||
+	    (img->block_length &&
+	     sparse_write(img, img->block_length, img->num_blocks * 4, offset + img->num_blocks * 8) < 0))
+		return;
+	fsync(img->fd);
+	memcpy(hdr.magic, SPARSE_MAGIC, 8);
+	sparse_write(img, &hdr, sizeof hdr, 0);
+}
+
+void image_close(struct image *img) {
+	u64 b;
+
+	if (!img) return;
+	if (img->format != IMAGE_RAW) {
+		if (img->writable) {
+			sparse_finish(img);
+			free(img->bitmap);
+			free(img->block_offset);
+			free(img->block_length);
+		}
+		if (img->decoded) {
+			for (b = 0; b < img->num_blocks; b++) free(img->decoded[b]);
+			free(img->decoded);
+		}
+		free(img->blank);
+		free(img->block_buf);
+		free(img->pack_buf);
+		free(img->frame_buf);
+	}
+	if (img->map) {
+#ifdef IMAGE_MMAP
+		if (img->writable) msync(img->map, img->map_size, MS_SYNC);
+		munmap(img->map, img->map_size);
+#else
+		if (img->writable) {
+			lseek(img->fd, 0, SEEK_SET);
+			if (write(img->fd, img->map, img->map_size) != img->map_size)
+				perror("Couldn't write image");
+		}
+		free(img->map);
+#endif
+	}
+	if (img->fd >= 0) close(img->fd);
+	free(img->filename);
+	free(img);
+}
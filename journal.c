@@ -0,0 +1,165 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Checkpoint journals.  A dump or program keeps nand.bin.journal next to
+   the image: a line saying what the job is, then the number of each block
+   it has finished, one per line, each synced to disk before the job goes
+   on.  After a dropped connection or a power cut, --resume takes up a
+   journal for the same job and skips the blocks in it, all but the last,
+   which is done again in case it was cut short.  A job that finishes
+   removes its journal. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "amoxiflash.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define JOURNAL_LINE_MAX 256
+
+static char *journal_filename(const char *image_filename) {
+	char *name = malloc(strlen(image_filename) + 9);
+	sprintf(name, "%s.journal", image_filename);
+	return name;
+}
+
+/* Read the blocks an earlier run of the job `key` finished into j->done.
+   Returns the last one recorded, or -1 if there are none. */
+static long journal_load(struct journal *j, const char *key) {
+	char line[JOURNAL_LINE_MAX], *end;
+	long last = -1;
+	u32 blockno;
+	FILE *fp;
+
+	if (!(fp = fopen(j->filename, "r"))) return -1;
+	if (!fgets(line, sizeof line, fp) || strncmp(line, key, strlen(key)) ||
+	    line[strlen(key)] != '\n') {
+		fprintf(stderr, "%s is from a different job; remove it to start over\n", j->filename);
+		fclose(fp);
+		exit(1);
+	}
+	while (fgets(line, sizeof line, fp)) {
+		blockno = strtoul(line, &end, 16);
+		/* a line cut short by the crash doesn't count */
+		if (end == line || *end != '\n' || blockno >= j->num_blocks) continue;
+		j->done[blockno] = 1;
+		last = blockno;
+	}
+	fclose(fp);
+	return last;
+}
+
+/* Start the journal for the job described by key (one line of text) on an
+   image of num_blocks blocks.  With resume, blocks an earlier run of the
+   same job finished are taken from its journal.  Returns NULL if the
+   journal can't be written, unless resuming (when that is fatal). */
+struct journal *journal_open(const char *image_filename, const char *key, u32 num_blocks, int resume) {
+	struct journal *j = calloc(1, sizeof *j);
+	char *tmp, line[JOURNAL_LINE_MAX];
+	long last = -1;
+	u32 blockno;
+	int fd, len;
+
+	j->filename = journal_filename(image_filename);
+	j->num_blocks = num_blocks;
+	j->done = calloc(num_blocks, 1);
+	if (resume) {
+		last = journal_load(j, key);
+		if (last < 0) printf("Nothing to resume in %s; starting from the beginning\n", j->filename);
+	} else if (access(j->filename, F_OK) == 0) {
+		printf("Starting over: %s is from an unfinished run (--resume would carry on)\n",
+			j->filename);
+	}
+	if (last >= 0) {
+		j->done[last] = 0;
+		for (blockno = 0; blockno < num_blocks; blockno++) j->resumed += j->done[blockno];
+		printf("Resuming from %s: %u blocks already done, block %04lx done again\n",
+			j->filename, j->resumed, last);
+	}
+
+	/* write out what is kept and swap it in, so that a crash now leaves
+	   one journal or the other */
+	tmp = malloc(strlen(j->filename) + 5);
+	sprintf(tmp, "%s.tmp", j->filename);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd < 0) goto fail;
+	len = snprintf(line, sizeof line, "%s\n", key);
+	if (write(fd, line, len) != len) goto fail;
+	for (blockno = 0; blockno < num_blocks; blockno++) {
+		if (!j->done[blockno]) continue;
+		len = snprintf(line, sizeof line, "%04x\n", blockno);
+		if (write(fd, line, len) != len) goto fail;
+	}
+	if (fsync(fd) < 0) goto fail;
+#ifdef __MINGW32__
+	unlink(j->filename);	/* rename() won't replace a file here */
+#endif
+	if (rename(tmp, j->filename) < 0) goto fail;
+	free(tmp);
+	j->fd = fd;
+	return j;
+
+fail:
+	/* without --resume the journal is only insurance: go on without it */
+	perror(tmp);
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	if (resume) exit(1);
+	printf("Carrying on without a journal; this run can't be resumed\n");
+	free(tmp);
+	free(j->filename);
+	free(j->done);
+	free(j);
+	return NULL;
+}
+
+/* Whether blockno was finished by an earlier run */
+int journal_done(struct journal *j, u32 blockno) {
+	return j && blockno < j->num_blocks && j->done[blockno];
+}
+
+/* Record that blockno is finished.  It is on disk when this returns. */
+int journal_add(struct journal *j, u32 blockno) {
+	char line[16];
+	int len;
+
+	if (!j) return 0;
+	len = snprintf(line, sizeof line, "%04x\n", blockno);
+	if (write(j->fd, line, len) != len || fsync(j->fd) < 0) {
+		perror(j->filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* The job is done: the journal goes */
+void journal_finish(struct journal *j) {
+	if (!j) return;
+	close(j->fd);
+	unlink(j->filename);
+	free(j->filename);
+	free(j->done);
+	free(j);
+}
@@ -0,0 +1,214 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Image manifests.  nand.bin.amx sits next to nand.bin and holds, for every
+   page, a 64-bit hash, the check_ecc() result and the sums bit count, a
+   bitmap of all-FF pages, and a hash per block.  The file is a fixed header
+   followed by plain arrays, so it is used straight from a mapping.  The
+   header records the image's size and mtime; a manifest that doesn't match
+   its image is ignored. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "amoxiflash.h"
+
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#define MANIFEST_MMAP
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define MANIFEST_MAGIC "AMXMANIF"
+
+char *manifest_filename(const char *image_filename) {
+	char *name = malloc(strlen(image_filename) + 5);
+	sprintf(name, "%s.amx", image_filename);
+	return name;
+}
+
+/* 64-bit hash of a page, a word at a time */
+u64 page_hash(const u8 *data, int len) {
+	u64 h = 0x9e3779b97f4a7c15ULL ^ len, w;
+	int i;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0x9fb21c651e98df25ULL;
+		h ^= h >> 32;
+	}
+	for (; i < len; i++) h = (h ^ data[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static u64 manifest_size(u64 num_pages, u64 num_blocks) {
+	return sizeof(struct manifest_header) + num_blocks * 8 + num_pages * (8 + 4 + 1)
+		+ (num_pages + 7) / 8;
+}
+
+static void manifest_layout(struct manifest *m) {
+	u8 *p = m->map + sizeof(struct manifest_header);
+	m->hdr = (struct manifest_header *)m->map;
+	m->block_hash = (u64 *)p;	p += m->hdr->num_blocks * 8;
+	m->page_hash = (u64 *)p;	p += m->hdr->num_pages * 8;
+	m->sums = (u32 *)p;		p += m->hdr->num_pages * 4;
+	m->ecc = p;			p += m->hdr->num_pages;
+	m->blank = p;
+}
+
+static int manifest_stat(const char *image_filename, u64 *size, u64 *mtime) {
+	struct stat st;
+	if (stat(image_filename, &st) < 0) return -1;
+	*size = st.st_size;
+	/* in ns where the platform has it: a rewrite within the second counts */
+#if defined(__APPLE__)
+	*mtime = st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	*mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#else
+	*mtime = st.st_mtime * 1000000000ULL;
+#endif
+	return 0;
+}
+
+/* Map the manifest of an image.  NULL if there is none, it is from another
+   version, or the image has changed since it was written. */
+struct manifest *manifest_open(const char *image_filename) {
+	struct manifest_header hdr;
+	struct manifest *m;
+	char *name = manifest_filename(image_filename);
+	u64 size, mtime;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_BINARY);
+	free(name);
+	if (fd < 0) return NULL;
+	if (read(fd, &hdr, sizeof hdr) != sizeof hdr ||
+	    memcmp(hdr.magic, MANIFEST_MAGIC, 8) || hdr.version != MANIFEST_VERSION ||
+	    hdr.page_len != page_size + spare_size || hdr.pages_per_block != pages_per_block ||
+	    manifest_stat(image_filename, &size, &mtime) < 0 ||
+	    hdr.image_size != size || hdr.image_mtime != mtime) {
+		close(fd);
+		return NULL;
+	}
+
+	m = calloc(1, sizeof *m);
+	m->fd = fd;
+	m->map_size = manifest_size(hdr.num_pages, hdr.num_blocks);
+#ifdef MANIFEST_MMAP
+	m->map = mmap(NULL, m->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m->map == MAP_FAILED) m->map = NULL;
+#else
+	m->map = malloc(m->map_size);
+	lseek(fd, 0, SEEK_SET);
+	if (m->map && read(fd, m->map, m->map_size) != m->map_size) {
+		free(m->map);
+		m->map = NULL;
+	}
+#endif
+	if (!m->map) {
+		close(fd);
+		free(m);
+		return NULL;
+	}
+	manifest_layout(m);
+	return m;
+}
+
+/* Create an empty manifest for an image of num_pages pages, mapped for
+   writing.  It isn't valid until manifest_finish(). */
+struct manifest *manifest_create(const char *image_filename, u64 num_pages) {
+	struct manifest *m;
+	char *name = manifest_filename(image_filename);
+	u64 num_blocks = num_pages / pages_per_block;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	free(name);
+	if (fd < 0) return NULL;
+
+	m = calloc(1, sizeof *m);
+	m->fd = fd;
+	m->writable = 1;
+	m->map_size = manifest_size(num_pages, num_blocks);
+#ifdef MANIFEST_MMAP
+	if (ftruncate(fd, m->map_size) < 0) {
+		m->map = NULL;
+	} else {
+		m->map = mmap(NULL, m->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (m->map == MAP_FAILED) m->map = NULL;
+	}
+#else
+	m->map = calloc(1, m->map_size);
+#endif
+	if (!m->map) {
+		int err = errno;
+		close(fd);
+		free(m);
+		errno = err;
+		return NULL;
+	}
+	m->hdr = (struct manifest_header *)m->map;
+	m->hdr->num_pages = num_pages;
+	m->hdr->num_blocks = num_blocks;
+	manifest_layout(m);
+	return m;
+}
+
+/* Fill in the block hashes and the header once every page entry is in.
+   The image must be closed by now, so that its mtime is final. */
+int manifest_finish(struct manifest *m, const char *image_filename) {
+	struct manifest_header *hdr = m->hdr;
+	u64 b;
+
+	for (b = 0; b < hdr->num_blocks; b++)
+		m->block_hash[b] = page_hash((u8 *)(m->page_hash + b * pages_per_block),
+			pages_per_block * 8);
+
+	if (manifest_stat(image_filename, &hdr->image_size, &hdr->image_mtime) < 0) return -1;
+	hdr->version = MANIFEST_VERSION;
+	hdr->header_size = sizeof *hdr;
+	hdr->page_len = page_size + spare_size;
+	hdr->pages_per_block = pages_per_block;
+	/* the magic goes in last: a half-written manifest never looks valid */
+	memcpy(hdr->magic, MANIFEST_MAGIC, 8);
+	return 0;
+}
+
+void manifest_close(struct manifest *m) {
+	if (!m) return;
+#ifdef MANIFEST_MMAP
+	if (m->writable) msync(m->map, m->map_size, MS_SYNC);
+	munmap(m->map, m->map_size);
+#else
+	if (m->writable) {
+		lseek(m->fd, 0, SEEK_SET);
+		if (write(m->fd, m->map, m->map_size) != m->map_size)
+			perror("Couldn't write manifest");
+	}
+	free(m->map);
+#endif
+	close(m->fd);
+	free(m);
+}
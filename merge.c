@@ -0,0 +1,113 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Rebuilding a page from several reads or dumps of it.  The ECC is the
+   judge wherever there is one: a copy that checks out is taken as is, and
+   failing that each 512-byte sector is taken from whichever copy has it
+   right.  Only then do the copies vote, bit by bit, and the result is held
+   up to the ECC again. */
+
+#include <string.h>
+#include "amoxiflash.h"
+
+#define PAGE_LEN (page_size + spare_size)
+
+/* Set each bit of out to the value most copies have; ties go to 1, the
+   erased state */
+static void vote(u8 **copies, int n, u8 *out, int start, int len) {
+	int i, c, bit, ones;
+	u8 b;
+
+	for (i = start; i < start + len; i++) {
+		for (c = 1; c < n; c++)
+			if (copies[c][i] != copies[0][i]) break;
+		if (c == n) {
+			out[i] = copies[0][i];
+			continue;
+		}
+		b = 0;
+		for (bit = 0; bit < 8; bit++) {
+			for (ones = c = 0; c < n; c++) ones += copies[c][i] >> bit & 1;
+			if (2 * ones >= n) b |= 1 << bit;
+		}
+		out[i] = b;
+	}
+}
+
+/* Build each sector from a copy whose sector ECC holds.  A copy that
+   needs a single-bit repair is only used if none is right as it stands:
+   three bad bits can pass for one.  Returns the number of sectors that
+   were repaired, or -1 if some sector wasn't found. */
+static int merge_sectors(u8 **copies, int n, u8 *out) {
+	u8 data[512], stored[4];
+	int s, c, repair, r = -1, repaired = 0;
+
+	for (s = 0; s < ECC_SECTORS; s++) {
+		for (repair = 0; repair < 2; repair++) {
+			for (c = 0; c < n; c++) {
+				memcpy(data, copies[c] + 512 * s, 512);
+				memcpy(stored, copies[c] + ECC_OFFSET + 4 * s, 4);
+				if (stored[0] == 0xff && stored[1] == 0xff) continue;
+				r = correct_sector(data, stored);
+				if (r == 0 || (r > 0 && repair)) break;
+			}
+			if (c < n) break;
+		}
+		if (repair == 2) return -1;
+		if (r == 1) repaired++;
+		memcpy(out + 512 * s, data, 512);
+		memcpy(out + ECC_OFFSET + 4 * s, stored, 4);
+	}
+	/* the rest of the spare area isn't covered by the ECC */
+	vote(copies, n, out, page_size, ECC_OFFSET - page_size);
+	return repaired;
+}
+
+/* Rebuild one page from n copies into out.  Returns how it was done
+   (MERGE_*) and leaves the result's check_ecc() class in *ecc, with
+   ECC_CORRECTED where single-bit errors were repaired. */
+int merge_page(u8 **copies, int n, u8 *out, int *ecc) {
+	int c, method, repaired;
+
+	for (c = 1; c < n; c++)
+		if (memcmp(copies[c], copies[0], PAGE_LEN)) break;
+	if (c == n) {
+		memcpy(out, copies[0], PAGE_LEN);
+		method = MERGE_SAME;
+	} else {
+		for (c = 0; c < n; c++)
+			if (check_ecc(copies[c]) == ECC_OK) break;
+		if (c < n) {
+			memcpy(out, copies[c], PAGE_LEN);
+			*ecc = ECC_OK;
+			return MERGE_ECC;
+		}
+		if (copies[0][page_size] == 0xff && (repaired = merge_sectors(copies, n, out)) >= 0) {
+			if (check_ecc(out) != ECC_OK) *ecc = ECC_WRONG;
+			else *ecc = repaired ? ECC_CORRECTED : ECC_OK;
+			return MERGE_SECTORS;
+		}
+		vote(copies, n, out, 0, PAGE_LEN);
+		method = MERGE_VOTE;
+	}
+
+	*ecc = check_ecc(out);
+	if (*ecc == ECC_WRONG && correct_page_ecc(out) >= 0) *ecc = ECC_CORRECTED;
+	if (*ecc == ECC_WRONG && method == MERGE_VOTE) method = MERGE_FAILED;
+	return method;
+}
@@ -0,0 +1,223 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Profiling (--profile).  Every command sent to the programmer is timed
+   from the start of its write to the end of its reply and counted against
+   its NAND opcode (or data send / receive, or other packets) in a
+   histogram with logarithmic buckets, 16 to each power of two, so that
+   percentiles come out within about 6% whatever the range.  The run is also
+   split into phases -- reading, comparing, erasing, programming, verifying
+   and waiting for status -- by wall clock, each phase's time not counting
+   the phases entered from it.  A summary of both is printed at exit.
+
+   With profiling off, each command costs a test of `profiling`. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "amoxiflash.h"
+
+#define PROFILE_SUB_BITS 4
+#define PROFILE_SUB (1 << PROFILE_SUB_BITS)
+#define PROFILE_BUCKETS ((32 - PROFILE_SUB_BITS + 1) * PROFILE_SUB)
+
+int profiling = 0;
+
+struct profile_stat {
+	u64 count, bytes_out, bytes_in, total, max;
+	u32 *hist;		/* [PROFILE_BUCKETS], allocated on first use */
+};
+
+static struct profile_stat commands[PROFILE_KEYS];
+static const char *phase_names[PHASES] = {
+	"other", "read", "compare", "erase", "program", "verify", "status"
+};
+static u64 phase_time[PHASES], phase_usb[PHASES], phase_commands[PHASES];
+static int phase = PHASE_OTHER;
+static u64 phase_since, profile_since;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+u64 profile_now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* What a packet is counted as: the opcode of a NAND command, else one of
+   the PROFILE_ keys */
+int profile_key(const u8 *packet) {
+	if (packet[0] != 0x4e) return PROFILE_OTHER;
+	if (packet[1] == 1) return PROFILE_SEND;
+	if (packet[1] == 2) return PROFILE_RECV;
+	return packet[8];
+}
+
+static int profile_bucket(u32 v) {
+	int shift = 0;
+	if (v < PROFILE_SUB) return v;
+	while (v >> shift >= 2 * PROFILE_SUB) shift++;
+	return (shift + 1) * PROFILE_SUB + (v >> shift) - PROFILE_SUB;
+}
+
+/* The highest value that falls in bucket i */
+static u64 profile_bucket_top(int i) {
+	int shift = i / PROFILE_SUB - 1;
+	if (i < PROFILE_SUB) return i;
+	return ((u64)(PROFILE_SUB + i % PROFILE_SUB) << shift) + (1ULL << shift) - 1;
+}
+
+/* A command of key sent out_bytes and got in_bytes back, having started
+   at start */
+void profile_record(int key, int out_bytes, int in_bytes, u64 start) {
+	struct profile_stat *s = &commands[key];
+	u64 usec = profile_now() - start;
+
+	pthread_mutex_lock(&profile_lock);
+	if (!s->hist) s->hist = calloc(PROFILE_BUCKETS, sizeof *s->hist);
+	s->count++;
+	s->bytes_out += out_bytes;
+	if (in_bytes > 0) s->bytes_in += in_bytes;
+	s->total += usec;
+	if (usec > s->max) s->max = usec;
+	s->hist[profile_bucket(usec > 0xffffffffULL ? 0xffffffff : usec)]++;
+	phase_usb[phase] += usec;
+	phase_commands[phase]++;
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/* Charge the time since the last switch to the phase that was running */
+static void profile_switch(int to) {
+	u64 now = profile_now();
+	phase_time[phase] += now - phase_since;
+	phase_since = now;
+	phase = to;
+}
+
+/* Start counting time against phase p.  Returns the phase to go back to
+   with profile_leave(). */
+int profile_enter(int p) {
+	int prev;
+	if (!profiling) return PHASE_OTHER;
+	pthread_mutex_lock(&profile_lock);
+	prev = phase;
+	profile_switch(p);
+	pthread_mutex_unlock(&profile_lock);
+	return prev;
+}
+
+void profile_leave(int prev) {
+	if (!profiling) return;
+	pthread_mutex_lock(&profile_lock);
+	profile_switch(prev);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/* The smallest value that at least fraction q of the samples are at or
+   under, to the bucket */
+static u64 profile_percentile(struct profile_stat *s, double q) {
+	u64 want = s->count * q + 0.5, seen = 0, top;
+	int i;
+	if (want < 1) want = 1;
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		seen += s->hist[i];
+		if (seen >= want) break;
+	}
+	top = profile_bucket_top(i);
+	return top < s->max ? top : s->max;
+}
+
+static const char *profile_name(int key, char *buf, int len) {
+	static const struct {
+		int key;
+		const char *name;
+	} names[] = {
+		{ 0x00, "read setup" }, { 0x30, "read" }, { 0x31, "cache read" },
+		{ 0x3f, "cache read end" }, { 0x60, "erase setup" }, { 0x70, "status" },
+		{ 0x80, "program setup" }, { 0x81, "plane program setup" },
+		{ 0x10, "program" }, { 0x11, "plane program" }, { 0x15, "cache program" },
+		{ 0x90, "read ID" }, { 0xd0, "erase" }, { 0xd1, "plane erase" },
+		{ 0xec, "read parameters" }, { 0xff, "reset" },
+		{ PROFILE_SEND, "send data" }, { PROFILE_RECV, "receive data" },
+		{ PROFILE_OTHER, "other packet" }, { PROFILE_BATCH, "batch" },
+	};
+	int i;
+	for (i = 0; i < sizeof names / sizeof names[0]; i++)
+		if (names[i].key == key) break;
+	if (key < 256)
+		snprintf(buf, len, "%02xh %s", key, i < sizeof names / sizeof names[0] ? names[i].name : "");
+	else
+		snprintf(buf, len, "%s", names[i].name);
+	return buf;
+}
+
+static void profile_summary(void) {
+	struct profile_stat *s;
+	char name[32];
+	u64 total;
+	int i;
+
+	pthread_mutex_lock(&profile_lock);
+	profile_switch(phase);
+	total = profile_now() - profile_since;
+	printf("\nProfile: %.3fs\n", total / 1000000.0);
+	printf("  phase          time       %%  commands    in USB\n");
+	for (i = 0; i < PHASES; i++) {
+		if (!phase_time[i] && !phase_commands[i]) continue;
+		printf("  %-8s %9.3fs  %5.1f%%  %8llu  %8.3fs\n", phase_names[i],
+			phase_time[i] / 1000000.0, total ? phase_time[i] * 100.0 / total : 0.0,
+			phase_commands[i], phase_usb[i] / 1000000.0);
+	}
+
+	printf("  command                 count   out KB    in KB   mean    p50    p90    p99      max (usec)\n");
+	for (i = 0; i < PROFILE_KEYS; i++) {
+		s = &commands[i];
+		if (!s->count) continue;
+		printf("  %-20s %8llu %8.1f %8.1f %6llu %6llu %6llu %6llu %8llu\n",
+			profile_name(i, name, sizeof name), s->count,
+			s->bytes_out / 1024.0, s->bytes_in / 1024.0, s->total / s->count,
+			profile_percentile(s, 0.5), profile_percentile(s, 0.9),
+			profile_percentile(s, 0.99), s->max);
+	}
+	pthread_mutex_unlock(&profile_lock);
+	fflush(stdout);
+}
+
+/* Start profiling from now, forgetting anything counted so far (a server
+   child doesn't want the server's bring-up).  The summary is printed at
+   exit. */
+void profile_start(void) {
+	static int registered = 0;
+	int i;
+
+	pthread_mutex_lock(&profile_lock);
+	for (i = 0; i < PROFILE_KEYS; i++) {
+		free(commands[i].hist);
+		memset(&commands[i], 0, sizeof commands[i]);
+	}
+	memset(phase_time, 0, sizeof phase_time);
+	memset(phase_usb, 0, sizeof phase_usb);
+	memset(phase_commands, 0, sizeof phase_commands);
+	phase = PHASE_OTHER;
+	phase_since = profile_since = profile_now();
+	pthread_mutex_unlock(&profile_lock);
+
+	if (!registered) atexit(profile_summary);
+	registered = 1;
+}
@@ -0,0 +1,269 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Server mode.  Bringing up the programmer (reset, version queries, chip
+   detection) takes seconds; "serve" does it once and then takes commands
+   on a UNIX socket, so that short jobs run back to back don't pay for it
+   each time.
+
+   As in gang mode, each request gets its own process: serve_start() forks
+   a child per connection and returns in the child, which carries on as a
+   normal run from just after bring-up, with its output sent down the
+   socket.  The server waits for it before taking the next request, so
+   requests never share the device.
+
+   A request is the client's working directory and arguments, each ending
+   in a NUL, and an empty string after the last.  The reply is the output,
+   then a NUL and the exit status as one byte. */
+
+#ifndef __MINGW32__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "amoxiflash.h"
+
+#define SERVE_FILE ".amoxiflash-socket"
+#define SERVE_REQUEST_MAX 65536
+#define SERVE_ARGS_MAX 256
+
+const char *serve_default_path(void) {
+	static char path[1024];
+	const char *home = getenv("HOME");
+	snprintf(path, sizeof path, "%s/%s", home ? home : ".", SERVE_FILE);
+	return path;
+}
+
+static int serve_address(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr->sun_path) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int serve_listen(const char *path) {
+	struct sockaddr_un addr;
+	int fd, probe;
+
+	if (serve_address(&addr, path) < 0) return -1;
+	/* a socket left by a server that died can go; a live one can't */
+	probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof addr) == 0) {
+		fprintf(stderr, "A server is already running on %s\n", path);
+		close(probe);
+		return -1;
+	}
+	if (probe >= 0) close(probe);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 8) < 0) {
+		perror(path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Whether buf holds a whole request: an empty string at a string boundary */
+static int serve_request_complete(const char *buf, int used) {
+	const char *p = buf, *end;
+	while (p < buf + used) {
+		if (!(end = memchr(p, 0, buf + used - p))) return 0;
+		if (end == p) return 1;
+		p = end + 1;
+	}
+	return 0;
+}
+
+/* Read a request into a NULL-terminated argv: the directory, then the
+   arguments.  NULL if the client goes away or sends nonsense. */
+static char **serve_read_request(int fd, int *argc) {
+	char *buf = malloc(SERVE_REQUEST_MAX), *p;
+	char **argv = calloc(SERVE_ARGS_MAX + 1, sizeof *argv);
+	int used = 0, n = 0;
+	ssize_t len;
+
+	while (!serve_request_complete(buf, used)) {
+		if (used == SERVE_REQUEST_MAX ||
+		    (len = read(fd, buf + used, SERVE_REQUEST_MAX - used)) <= 0) {
+			free(buf);
+			free(argv);
+			return NULL;
+		}
+		used += len;
+	}
+	for (p = buf; *p && n < SERVE_ARGS_MAX; p += strlen(p) + 1)
+		argv[n++] = p;
+	*argc = n;
+	return argv;
+}
+
+/* Listen on path and serve requests until killed.  Returns only in a child,
+   with the request's arguments laid out as main()'s argv (progname first)
+   in *argv, the client's directory as the working directory, and stdout and
+   stderr going to the client. */
+int serve_start(const char *path, char ***argv) {
+	int listen_fd, fd, argc, status, code, i;
+	char **req, line[256];
+	time_t start;
+	pid_t pid;
+	u8 trailer[2];
+
+	if ((listen_fd = serve_listen(path)) < 0) exit(1);
+	printf("Serving on %s\n", path);
+	/* a client that goes away must not take the server with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		fflush(stdout);
+		if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+			if (errno != EINTR) perror("accept");
+			continue;
+		}
+		if (!(req = serve_read_request(fd, &argc))) {
+			close(fd);
+			continue;
+		}
+		if (argc < 2) {
+			free(req[0]);
+			free(req);
+			close(fd);
+			continue;
+		}
+		snprintf(line, sizeof line, "%s", req[1]);
+		for (i = 2; i < argc; i++)
+			snprintf(line + strlen(line), sizeof line - strlen(line), " %s", req[i]);
+		printf("%s\n", line);
+		fflush(stdout);
+		fflush(stderr);
+
+		start = time(NULL);
+		if ((pid = fork()) < 0) {
+			perror("fork");
+			close(fd);
+			free(req[0]);
+			free(req);
+			continue;
+		}
+		if (pid == 0) {
+			signal(SIGPIPE, SIG_DFL);
+			close(listen_fd);
+			dup2(fd, 1);
+			dup2(fd, 2);
+			close(fd);
+			if (chdir(req[0]) < 0) {
+				perror(req[0]);
+				exit(1);
+			}
+			/* the directory's slot becomes progname */
+			req[0] = progname;
+			*argv = req;
+			return argc;
+		}
+
+		waitpid(pid, &status, 0);
+		code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		trailer[0] = 0;
+		trailer[1] = code;
+		if (write(fd, trailer, 2) != 2) printf("  client went away\n");
+		close(fd);
+		printf("  exit %d, %lds\n", code, (long)(time(NULL) - start));
+		if (!WIFEXITED(status)) {
+			/* it may have stopped halfway through a command */
+			printf("  resetting the programmer\n");
+			infectus_reset();
+		}
+		free(req[0]);
+		free(req);
+	}
+}
+
+/* Run a command on the server at path: send argv (as main() got it) and
+   the working directory, and copy the output to stdout.  Returns the
+   command's exit status. */
+int serve_client(const char *path, int argc, char **argv) {
+	struct sockaddr_un addr;
+	char cwd[4096], buf[4096], *nul;
+	int fd, i, seen_end = 0;
+	ssize_t len, n;
+
+	if (serve_address(&addr, path) < 0) return 1;
+	if (!getcwd(cwd, sizeof cwd)) {
+		perror("getcwd");
+		return 1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		fprintf(stderr, "Couldn't reach the server on %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (write(fd, cwd, strlen(cwd) + 1) < 0) goto lost;
+	for (i = 1; i < argc; i++)
+		if (write(fd, argv[i], strlen(argv[i]) + 1) < 0) goto lost;
+	if (write(fd, "", 1) < 0) goto lost;
+
+	fflush(stdout);
+	while ((len = read(fd, buf, sizeof buf)) > 0) {
+		if (seen_end) return (u8)buf[0];
+		nul = memchr(buf, 0, len);
+		n = nul ? nul - buf : len;
+		if (write(1, buf, n) < 0) break;
+		if (!nul) continue;
+		/* the NUL, then the status, possibly in the next read */
+		if (n + 1 < len) return (u8)buf[n + 1];
+		seen_end = 1;
+	}
+lost:
+	fprintf(stderr, "Lost the connection to the server\n");
+	return 1;
+}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "amoxiflash.h"
+
+const char *serve_default_path(void) {
+	return NULL;
+}
+
+int serve_start(const char *path, char ***argv) {
+	fprintf(stderr, "The server is not supported on this platform\n");
+	exit(1);
+}
+
+int serve_client(const char *path, int argc, char **argv) {
+	fprintf(stderr, "The server is not supported on this platform\n");
+	return 1;
+}
+
+#endif
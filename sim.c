@@ -0,0 +1,803 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Simulated Infectus + large-block NAND, used in place of the USB transport
+   so that dump / program / erase can be exercised without a programmer.
+
+   It decodes the 0x45 / 0x4c / 0x4e packets described in InfectusUSBProtocol,
+   keeps the NAND array either in memory (sparse; unwritten pages read as FF)
+   or in a raw dump-format file, padded with FF to the size of the array
+   when it is opened so that no page reads back as a hole, and charges a configurable round-trip latency
+   for every transfer plus tR / tPROG / tBERS for array operations.
+
+   Replies are queued with the time at which they would arrive, so a host
+   that keeps several commands in flight sees the latencies overlap the way
+   they would on the bus. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "amoxiflash.h"
+
+#ifdef __MINGW32__
+#define fseeko fseeko64
+#define ftello ftello64
+#define usleep(x) _sleep((x)/1000)
+#endif
+
+#define SIM_PAGE_LEN_MAX (8192 + 1024)
+#define SIM_REPLY_SIZE 4096
+#define SIM_QUEUE_SIZE 64
+#define SIM_CHIPS_MAX 2
+
+#define SIM_STATUS_READY 0xe0
+#define SIM_STATUS_BUSY 0x80
+#define SIM_STATUS_RB 0x40		/* takes commands */
+#define SIM_STATUS_ARRAY 0x20		/* no array operation running */
+#define SIM_T_CBSY 3			/* usec: cache register hand-over */
+
+/* What the NAND data output currently presents */
+enum sim_output { OUT_NONE, OUT_ID, OUT_ONFI, OUT_PARAMS, OUT_STATUS, OUT_PAGE, OUT_CACHE };
+
+struct sim_reply {
+	u8 data[SIM_REPLY_SIZE];
+	int len;
+	unsigned long long ready;
+};
+
+/* One NAND chip.  The 2-chip programmer has two, each with its own array,
+   page register and ready/busy line; 45 14 selects which one the NAND
+   commands go to. */
+struct sim_chip {
+	/* backing store */
+	u8 **pages;		/* memory backend, NULL == erased */
+	FILE *fp;		/* file backend */
+	u8 *bad;		/* factory bad blocks, NULL if none */
+
+	/* NAND state */
+	u8 reg[SIM_PAGE_LEN_MAX];	/* page register */
+	u8 cache[SIM_PAGE_LEN_MAX];	/* cache register, for cache reads */
+	u8 plane_reg[SIM_PAGE_LEN_MAX];	/* first-plane page of a multi-plane program */
+	u32 col;
+	u32 row;
+	u32 plane_row;
+	int plane_queued;	/* 11h seen: plane_reg goes with the next confirm */
+	u32 erase_row[2];	/* two for a multi-plane erase */
+	int erase_rows;
+	enum sim_output output;
+	u32 id_pos;
+	unsigned long long busy_until;	/* R/B */
+	unsigned long long array_until;	/* >= busy_until; later during cache ops */
+
+	/* counters, printed on close when debugging */
+	u32 reads, programs, erases;
+	u32 bad_ops;		/* erases / programs aimed at a bad block */
+	u32 plane_errors;	/* multi-plane pairs the chip would reject */
+};
+
+static struct {
+	/* configuration */
+	u8 id[5];
+	int onfi;		/* answers 90h-20h with "ONFI" and has a parameter page */
+	u8 params[3 * 256];
+	u32 num_blocks;
+	int page_size, spare_size, page_len, pages_per_block;
+	u32 latency;		/* usec per bulk transfer round trip */
+	u32 t_read, t_prog, t_erase;	/* usec */
+	int planes;		/* the block number's low bits pick the plane */
+	u8 pld_id;
+	int coalesce;		/* firmware accepts several packets per transfer */
+	int buffer;		/* transfers beyond this many bytes get garbled */
+	u32 flip, flip_bits;	/* every flip'th page read has flip_bits bits wrong */
+	int num_chips;
+
+	struct sim_chip chip[SIM_CHIPS_MAX];
+	struct sim_chip *cur;	/* selected chip */
+
+	/* reply being built for the current command */
+	u8 reply[SIM_REPLY_SIZE];
+	int reply_len;
+
+	/* replies not yet collected by bulk_read */
+	struct sim_reply queue[SIM_QUEUE_SIZE];
+	unsigned int queue_head, queue_tail;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	u32 transfers;
+} sim;
+
+static unsigned long long sim_now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* R/B: the chip takes no command until it is ready, so the firmware waits */
+static void sim_wait_ready(void) {
+	unsigned long long now = sim_now();
+	if (now < sim.cur->busy_until) usleep(sim.cur->busy_until - now);
+}
+
+/* Start an array operation taking usec, once the array is free.  R/B
+   stays busy until it is done, or with rb_usec set (cache operations)
+   only that long after it starts. */
+static void sim_array_op(u32 usec, u32 rb_usec) {
+	unsigned long long t = sim_now();
+	if (t < sim.cur->array_until) t = sim.cur->array_until;
+	sim.cur->array_until = t + usec;
+	sim.cur->busy_until = t + (rb_usec ? rb_usec : usec);
+}
+
+static void sim_set_busy(u32 usec) {
+	sim_array_op(usec, 0);
+}
+
+static u32 sim_num_pages(void) {
+	return sim.num_blocks * sim.pages_per_block;
+}
+
+static int sim_is_bad(u32 row) {
+	return sim.cur->bad && sim.cur->bad[row / sim.pages_per_block];
+}
+
+static void sim_load_page(u32 row, u8 *dst) {
+	memset(dst, 0xff, sim.page_len);
+	if (row >= sim_num_pages()) return;
+	if (sim.cur->fp) {
+		fseeko(sim.cur->fp, (off_t)row * sim.page_len, SEEK_SET);
+		if (fread(dst, 1, sim.page_len, sim.cur->fp) != sim.page_len) {
+			/* past EOF: reads as erased */
+			clearerr(sim.cur->fp);
+		}
+	} else if (sim.cur->pages[row]) {
+		memcpy(dst, sim.cur->pages[row], sim.page_len);
+	}
+	/* the factory mark, in the first two pages */
+	if (sim_is_bad(row) && row % sim.pages_per_block < 2) dst[sim.page_size] = 0;
+}
+
+static void sim_store_page(u32 row, u8 *src) {
+	if (row >= sim_num_pages()) return;
+	if (sim.cur->fp) {
+		fseeko(sim.cur->fp, (off_t)row * sim.page_len, SEEK_SET);
+		fwrite(src, 1, sim.page_len, sim.cur->fp);
+	} else {
+		if (!sim.cur->pages[row]) sim.cur->pages[row] = malloc(sim.page_len);
+		memcpy(sim.cur->pages[row], src, sim.page_len);
+	}
+}
+
+/* Rows a multi-plane operation can take together: the same page of
+   blocks in different planes */
+static int sim_plane_pair(u32 a, u32 b) {
+	return sim.planes > 1 && a % sim.pages_per_block == b % sim.pages_per_block &&
+		(a / sim.pages_per_block) % sim.planes != (b / sim.pages_per_block) % sim.planes;
+}
+
+/* Programming can only clear bits, like the real array */
+static void sim_program_row(u32 row, u8 *src) {
+	u8 page[SIM_PAGE_LEN_MAX];
+	int i;
+
+	if (sim_is_bad(row)) {
+		sim.cur->bad_ops++;
+		return;
+	}
+	sim_load_page(row, page);
+	for (i = 0; i < sim.page_len; i++) page[i] &= src[i];
+	sim_store_page(row, page);
+	sim.cur->programs++;
+}
+
+/* A cache program frees the page register (and R/B) as soon as the array
+   takes the data.  A page queued with 11h is programmed alongside, in the
+   same tPROG; if the two can't go together only the last one is taken. */
+static void sim_program_page(u32 row, int cache) {
+	sim_array_op(sim.t_prog, cache ? SIM_T_CBSY : 0);
+	if (sim.cur->plane_queued) {
+		sim.cur->plane_queued = 0;
+		if (sim_plane_pair(sim.cur->plane_row, row))
+			sim_program_row(sim.cur->plane_row, sim.cur->plane_reg);
+		else sim.cur->plane_errors++;
+	}
+	sim_program_row(row, sim.cur->reg);
+}
+
+static void sim_erase_block(u32 row) {
+	u8 blank[SIM_PAGE_LEN_MAX];
+	u32 first = row - (row % sim.pages_per_block), i;
+
+	if (sim_is_bad(row)) {
+		sim.cur->bad_ops++;
+		return;
+	}
+	memset(blank, 0xff, sizeof blank);
+	for (i = first; i < first + sim.pages_per_block && i < sim_num_pages(); i++) {
+		if (sim.cur->fp) {
+			sim_store_page(i, blank);
+		} else if (sim.cur->pages[i]) {
+			free(sim.cur->pages[i]);
+			sim.cur->pages[i] = NULL;
+		}
+	}
+	sim.cur->erases++;
+}
+
+/* Erase confirm: the block(s) set up with 60h, all in one tBERS */
+static void sim_erase(void) {
+	struct sim_chip *c = sim.cur;
+	if (c->erase_rows == 2 && !sim_plane_pair(c->erase_row[0], c->erase_row[1])) {
+		c->plane_errors++;
+		c->erase_row[0] = c->erase_row[1];
+		c->erase_rows = 1;
+	}
+	if (c->erase_rows == 2) sim_erase_block(c->erase_row[1]);
+	if (c->erase_rows) sim_erase_block(c->erase_row[0]);
+	c->erase_rows = 0;
+	sim_set_busy(sim.t_erase);
+}
+
+static u8 sim_output_byte(void) {
+	u8 b = 0xff;
+	switch (sim.cur->output) {
+		case OUT_ID:
+			if (sim.cur->id_pos < sizeof sim.id) b = sim.id[sim.cur->id_pos];
+			sim.cur->id_pos++;
+			break;
+		case OUT_ONFI:
+			if (sim.cur->id_pos < 4) b = "ONFI"[sim.cur->id_pos];
+			sim.cur->id_pos++;
+			break;
+		case OUT_PARAMS:
+			if (sim.cur->col < sizeof sim.params) b = sim.params[sim.cur->col];
+			sim.cur->col++;
+			break;
+		case OUT_STATUS:
+			b = SIM_STATUS_BUSY;
+			if (sim_now() >= sim.cur->busy_until) b |= SIM_STATUS_RB;
+			if (sim_now() >= sim.cur->array_until) b |= SIM_STATUS_ARRAY;
+			break;
+		case OUT_PAGE:
+			if (sim.cur->col < sim.page_len) b = sim.cur->reg[sim.cur->col];
+			sim.cur->col++;
+			break;
+		case OUT_CACHE:
+			if (sim.cur->col < sim.page_len) b = sim.cur->cache[sim.cur->col];
+			sim.cur->col++;
+			break;
+		default: break;
+	}
+	return b;
+}
+
+/* A transient read error: flip_bits bits of one sector of the register */
+static void sim_flip_bits(void) {
+	u32 sector = rand() % (sim.page_size / 512), i, bit;
+	for (i = 0; i < sim.flip_bits; i++) {
+		bit = rand() % (512 * 8);
+		sim.cur->reg[sector * 512 + bit / 8] ^= 1 << (bit % 8);
+	}
+}
+
+/* Load page row into the page register, as the array does for a read */
+static void sim_read_array(u32 row) {
+	sim_load_page(row, sim.cur->reg);
+	sim.cur->reads++;
+	if (sim.flip && sim.cur->reads % sim.flip == 0) sim_flip_bits();
+}
+
+/* Execute one raw NAND opcode (4e 00 ... len op params) */
+static void sim_nand_command(u8 op, u8 *p, int nparams) {
+	if (op != 0x70 && op != 0xff) sim_wait_ready();
+	switch (op) {
+		case 0xff:	/* reset */
+			sim.cur->output = OUT_NONE;
+			sim.cur->erase_rows = 0;
+			sim.cur->plane_queued = 0;
+			break;
+		case 0x90:	/* read ID; address 20h is the ONFI signature */
+			sim.cur->output = sim.onfi && p[0] == 0x20 ? OUT_ONFI : OUT_ID;
+			sim.cur->id_pos = 0;
+			break;
+		case 0xec:	/* read ONFI parameter page */
+			if (!sim.onfi) {
+				if (debug_mode) printf("sim: ignoring NAND opcode %02x\n", op);
+				break;
+			}
+			sim_set_busy(sim.t_read);
+			sim.cur->col = 0;
+			sim.cur->output = OUT_PARAMS;
+			break;
+		case 0x70:	/* read status */
+			sim.cur->output = OUT_STATUS;
+			break;
+		case 0x60:	/* erase setup; a second one before D0h is multi-plane */
+			if (sim.cur->erase_rows == 2) sim.cur->erase_rows = 1;
+			sim.cur->erase_row[sim.cur->erase_rows++] = p[0] | p[1] << 8 | p[2] << 16;
+			break;
+		case 0xd1:	/* multi-plane erase, between the two setups (Micron) */
+			break;
+		case 0xd0:	/* erase confirm */
+			sim_erase();
+			sim.cur->output = OUT_NONE;
+			break;
+		case 0x00:	/* read setup */
+			sim.cur->col = p[0] | p[1] << 8;
+			sim.cur->row = p[2] | p[3] << 8 | p[4] << 16;
+			break;
+		case 0x30:	/* read confirm */
+			sim_set_busy(sim.t_read);
+			sim_read_array(sim.cur->row);
+			sim.cur->output = OUT_PAGE;
+			break;
+		case 0x31:	/* cache read: hand the page over, start on the next */
+		case 0x3f:	/* cache read, last page */
+			if (op == 0x31) sim_array_op(sim.t_read, SIM_T_CBSY);
+			else sim_array_op(SIM_T_CBSY, 0);
+			memcpy(sim.cur->cache, sim.cur->reg, sim.page_len);
+			if (op == 0x31) sim_read_array(++sim.cur->row);
+			sim.cur->col = 0;
+			sim.cur->output = OUT_CACHE;
+			break;
+		case 0x80:	/* program setup */
+		case 0x81:	/* program setup, second plane */
+			memset(sim.cur->reg, 0xff, sizeof sim.cur->reg);
+			sim.cur->col = p[0] | p[1] << 8;
+			sim.cur->row = p[2] | p[3] << 8 | p[4] << 16;
+			sim.cur->output = OUT_NONE;
+			break;
+		case 0x10:	/* program confirm */
+			sim_program_page(sim.cur->row, 0);
+			sim.cur->output = OUT_NONE;
+			break;
+		case 0x15:	/* cache program: ready for the next page while this one programs */
+			sim_program_page(sim.cur->row, 1);
+			sim.cur->output = OUT_NONE;
+			break;
+		case 0x11:	/* multi-plane program: hold this page for the next confirm */
+			memcpy(sim.cur->plane_reg, sim.cur->reg, sim.page_len);
+			sim.cur->plane_row = sim.cur->row;
+			sim.cur->plane_queued = 1;
+			sim.cur->output = OUT_NONE;
+			break;
+		default:
+			if (debug_mode) printf("sim: ignoring NAND opcode %02x\n", op);
+			break;
+	}
+}
+
+static void sim_command(u8 *buf, int len) {
+	int i, n;
+
+	sim.reply[0] = 0xff;
+	sim.reply_len = 1;
+
+	switch (buf[0]) {
+		case 0x45:
+			switch (buf[1]) {
+				case 0x13:	/* chip revision */
+					sim.reply[1] = 0x82;
+					sim.reply_len = 2;
+					break;
+				case 0x14:	/* select bank */
+					if (buf[2] < sim.num_chips) sim.cur = &sim.chip[buf[2]];
+					break;
+				case 0x15:	/* reset */
+				default:
+					break;
+			}
+			break;
+		case 0x4c:
+			switch (buf[1]) {
+				case 0x07:	/* loader version */
+					sim.reply[1] = 1;
+					sim.reply[2] = 0;
+					sim.reply_len = 3;
+					break;
+				case 0x15:	/* PLD ID */
+					sim.reply[1] = sim.pld_id;
+					sim.reply_len = 2;
+					break;
+				default:
+					break;
+			}
+			break;
+		case 0x4e:
+			n = buf[6] << 8 | buf[7];
+			switch (buf[1]) {
+				case 0x00:
+					if (len >= 9) sim_nand_command(buf[8], buf + 9, n);
+					break;
+				case 0x01:	/* data in */
+					for (i = 0; i < n && 8 + i < len; i++, sim.cur->col++)
+						if (sim.cur->col < sim.page_len && i < sim.buffer)
+							sim.cur->reg[sim.cur->col] = buf[8 + i];
+					break;
+				case 0x02:	/* data out */
+					if (n > SIM_REPLY_SIZE - 1) n = SIM_REPLY_SIZE - 1;
+					if (sim.cur->output == OUT_PAGE || sim.cur->output == OUT_CACHE ||
+					    sim.cur->output == OUT_PARAMS)
+						sim_wait_ready();
+					for (i = 0; i < n; i++) sim.reply[1 + i] = sim_output_byte();
+					for (i = sim.buffer; i < n; i++) sim.reply[1 + i] = 0;
+					sim.reply_len = 1 + n;
+					break;
+				default:
+					break;
+			}
+			break;
+		default:
+			if (debug_mode) printf("sim: unknown command category %02x\n", buf[0]);
+			break;
+	}
+}
+
+static void sim_deadline(struct timespec *ts, int timeout) {
+	unsigned long long t = sim_now() + timeout * 1000ULL;
+	ts->tv_sec = t / 1000000;
+	ts->tv_nsec = (t % 1000000) * 1000;
+}
+
+/* Length of the packet at buf, as the firmware would work it out from the
+   first eight bytes */
+static int sim_packet_len(u8 *buf, int len) {
+	int n;
+
+	if (len < 8) return len;
+	if (buf[0] != 0x4e) return 8;
+	switch (buf[1]) {
+		case 0x00: n = 9 + buf[7]; break;
+		case 0x01: n = 8 + (buf[6] << 8 | buf[7]); break;
+		default: n = 8; break;
+	}
+	return n < len ? n : len;
+}
+
+static int sim_bulk_write(u8 *buf, int len, int timeout) {
+	struct sim_reply *r;
+	struct timespec ts;
+	int off, plen;
+
+	sim_deadline(&ts, timeout);
+	/* several packets may be coalesced into one transfer; each gets a reply */
+	for (off = 0; off < len; off += plen) {
+		plen = sim_packet_len(buf + off, len - off);
+
+		pthread_mutex_lock(&sim.lock);
+		/* like the real endpoint, stop accepting commands while replies back up */
+		while (sim.queue_tail - sim.queue_head >= SIM_QUEUE_SIZE) {
+			if (pthread_cond_timedwait(&sim.cond, &sim.lock, &ts) == ETIMEDOUT) {
+				pthread_mutex_unlock(&sim.lock);
+				return off ? off : -ETIMEDOUT;
+			}
+		}
+		pthread_mutex_unlock(&sim.lock);
+
+		/* only the writer touches the NAND state; array waits happen unlocked */
+		sim_command(buf + off, plen);
+
+		pthread_mutex_lock(&sim.lock);
+		r = &sim.queue[sim.queue_tail % SIM_QUEUE_SIZE];
+		memcpy(r->data, sim.reply, sim.reply_len);
+		r->len = sim.reply_len;
+		r->ready = sim_now() + sim.latency;
+		sim.queue_tail++;
+		pthread_cond_broadcast(&sim.cond);
+		pthread_mutex_unlock(&sim.lock);
+
+		/* older firmware: anything after the first packet is dropped */
+		if (!sim.coalesce) break;
+	}
+	return len;
+}
+
+static int sim_bulk_read(u8 *buf, int len, int timeout) {
+	struct sim_reply *r;
+	struct timespec ts;
+	unsigned long long ready, now;
+	int n;
+
+	sim_deadline(&ts, timeout);
+	pthread_mutex_lock(&sim.lock);
+	while (sim.queue_head == sim.queue_tail) {
+		if (pthread_cond_timedwait(&sim.cond, &sim.lock, &ts) == ETIMEDOUT) {
+			pthread_mutex_unlock(&sim.lock);
+			return -ETIMEDOUT;
+		}
+	}
+	r = &sim.queue[sim.queue_head % SIM_QUEUE_SIZE];
+	n = r->len;
+	if (n > len) n = len;
+	memcpy(buf, r->data, n);
+	ready = r->ready;
+	sim.queue_head++;
+	sim.transfers++;
+	pthread_cond_broadcast(&sim.cond);
+	pthread_mutex_unlock(&sim.lock);
+
+	now = sim_now();
+	if (now < ready) usleep(ready - now);
+	return n;
+}
+
+static int sim_reset(void) {
+	return 0;
+}
+
+static const char *sim_strerror(void) {
+	return "simulated device error";
+}
+
+static void sim_close(void) {
+	struct sim_chip *c;
+	u32 i;
+	int n;
+
+	for (n = 0; n < sim.num_chips; n++) {
+		c = &sim.chip[n];
+		if (debug_mode)
+			printf("sim: chip %d: %u page reads, %u page programs, %u block erases, "
+				"%u operations on bad blocks, %u bad multi-plane pairs\n",
+				n, c->reads, c->programs, c->erases, c->bad_ops, c->plane_errors);
+		if (c->fp) {
+			fclose(c->fp);
+			c->fp = NULL;
+		}
+		if (c->pages) {
+			for (i = 0; i < sim_num_pages(); i++) free(c->pages[i]);
+			free(c->pages);
+			c->pages = NULL;
+		}
+		free(c->bad);
+		c->bad = NULL;
+	}
+	if (debug_mode) printf("sim: %u transfers\n", sim.transfers);
+}
+
+static struct transport sim_transport = {
+	"simulator",
+	sim_reset,
+	sim_bulk_write,
+	sim_bulk_read,
+	sim_strerror,
+	sim_close
+};
+
+/* An erased array, from the end of the file on */
+static int sim_extend_file(FILE *fp) {
+	u8 blank[65536];
+	off_t size, end = (off_t)sim_num_pages() * sim.page_len;
+	size_t n;
+
+	if (fseeko(fp, 0, SEEK_END) < 0 || (size = ftello(fp)) < 0) return -1;
+	memset(blank, 0xff, sizeof blank);
+	for (; size < end; size += n) {
+		n = end - size < sizeof blank ? end - size : sizeof blank;
+		if (fwrite(blank, 1, n, fp) != n) return -1;
+	}
+	return fflush(fp);
+}
+
+/* Open the backing store for one chip: a dump-format file, or memory if
+   filename is NULL */
+/* bad is a colon-separated list of block numbers, e.g. "5:0x3f0" */
+static int sim_open_chip(struct sim_chip *c, const char *filename, const char *bad) {
+	char *end;
+	u32 blockno;
+
+	for (; bad && *bad; bad = *end ? end + 1 : end) {
+		blockno = strtoul(bad, &end, 0);
+		if (end == bad || blockno >= sim.num_blocks) {
+			fprintf(stderr, "sim: bad block list '%s' isn't valid\n", bad);
+			return -1;
+		}
+		if (!c->bad) c->bad = calloc(sim.num_blocks, 1);
+		c->bad[blockno] = 1;
+	}
+	if (filename) {
+		c->fp = fopen(filename, "r+b");
+		if (!c->fp) c->fp = fopen(filename, "w+b");
+		if (!c->fp) {
+			perror("sim: couldn't open backing file");
+			return -1;
+		}
+		if (sim_extend_file(c->fp) < 0) {
+			perror("sim: couldn't extend backing file");
+			return -1;
+		}
+	} else {
+		c->pages = calloc(sim_num_pages(), sizeof *c->pages);
+		if (!c->pages) {
+			fprintf(stderr, "sim: out of memory\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int sim_log2(u32 n) {
+	int i;
+	for (i = 0; n > 1; i++) n >>= 1;
+	return i;
+}
+
+/* The ID bytes after the first two describe the geometry, the way the
+   Samsung parts (and most others) encode it */
+static void sim_make_id(u32 id) {
+	u32 block_bytes = sim.page_size * sim.pages_per_block;
+	u64 plane_bytes = (u64)block_bytes * sim.num_blocks / sim.planes;
+
+	sim.id[0] = id >> 8;
+	sim.id[1] = id;
+	sim.id[2] = 0x10;
+	sim.id[3] = 0x80 | sim_log2(block_bytes / (64 * 1024)) << 4 |
+		(sim.spare_size / (sim.page_size / 512) == 16) << 2 | sim_log2(sim.page_size / 1024);
+	sim.id[4] = sim_log2(plane_bytes / (8 * 1024 * 1024)) << 4 | sim_log2(sim.planes) << 2;
+}
+
+static void sim_put16(u8 *p, u32 v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void sim_put32(u8 *p, u32 v) {
+	sim_put16(p, v);
+	sim_put16(p + 2, v >> 16);
+}
+
+/* An ONFI 1.0 parameter page for the simulated geometry, three times over */
+static void sim_make_params(void) {
+	u8 *p = sim.params;
+	int i;
+
+	memset(p, 0, 256);
+	memcpy(p, "ONFI", 4);
+	sim_put16(p + 4, 1 << 1);				/* ONFI 1.0 */
+	sim_put16(p + 6, sim.planes > 1 ? 1 << 3 : 0);	/* multi-plane */
+	sim_put16(p + 8, 1 << 0 | 1 << 1);			/* cache program, cache read */
+	memcpy(p + 32, "SIMULATED   ", 12);
+	snprintf((char *)p + 44, 21, "NAND %02X%02X%-11s", sim.id[0], sim.id[1], "");
+	sim_put32(p + 80, sim.page_size);
+	sim_put16(p + 84, sim.spare_size);
+	sim_put32(p + 92, sim.pages_per_block);
+	sim_put32(p + 96, sim.num_blocks);
+	p[100] = 1;						/* LUNs */
+	p[101] = 0x23;						/* address cycles */
+	p[113] = sim_log2(sim.planes);				/* interleaved address bits */
+	sim_put16(p + 133, sim.t_prog);
+	sim_put16(p + 135, sim.t_erase);
+	sim_put16(p + 137, sim.t_read);
+	sim_put16(p + 254, onfi_crc(p, 254));
+	for (i = 1; i < 3; i++) memcpy(p + 256 * i, p, 256);
+}
+
+/* spec is a comma-separated list of key=value settings, e.g.
+   "file=nand.bin,latency=125,id=ecdc".  "mem" (or an empty spec) keeps the
+   array in memory.  "chips=2" simulates the 2-chip programmer; the second
+   chip is backed by file1= (or memory).  "bad=5:9" marks blocks 5 and 9
+   of chip 0 factory bad (bad1= for chip 1): they carry the mark and can't
+   be erased or programmed.  "planes=1" turns off the multi-plane
+   commands of the 512MB parts.  The geometry follows the ID unless set
+   with page=, spare=, ppb= and blocks=; "onfi=1" gives the chip an ONFI
+   parameter page.  A chip whose geometry was set has one unless onfi=0,
+   since the host would otherwise take the ID's geometry from its table. */
+struct transport *sim_open(const char *spec) {
+	char *copy, *tok, *val;
+	char *filename[SIM_CHIPS_MAX] = { NULL, NULL };
+	char *bad[SIM_CHIPS_MAX] = { NULL, NULL };
+	u32 id = 0xecdc;
+	int pld = -1, n, err = 0, geometry_set = 0;
+
+	memset(&sim, 0, sizeof sim);
+	pthread_mutex_init(&sim.lock, NULL);
+	pthread_cond_init(&sim.cond, NULL);
+	sim.latency = 0;
+	sim.t_read = 25;
+	sim.t_prog = 200;
+	sim.t_erase = 1500;
+	sim.coalesce = 1;
+	sim.buffer = 1056;
+	sim.flip_bits = 2;
+	sim.num_chips = 1;
+	sim.planes = 0;
+	sim.onfi = -1;
+
+	copy = strdup(spec ? spec : "");
+	for (tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+		val = strchr(tok, '=');
+		if (val) *val++ = 0;
+		if (!strcmp(tok, "mem")) continue;
+		if (!val) {
+			fprintf(stderr, "sim: setting '%s' needs a value\n", tok);
+			free(copy);
+			return NULL;
+		}
+		if (!strcmp(tok, "file")) filename[0] = strdup(val);
+		else if (!strcmp(tok, "file1")) filename[1] = strdup(val);
+		else if (!strcmp(tok, "bad")) bad[0] = strdup(val);
+		else if (!strcmp(tok, "bad1")) bad[1] = strdup(val);
+		else if (!strcmp(tok, "chips")) sim.num_chips = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "id")) id = strtoul(val, NULL, 16);
+		else if (!strcmp(tok, "blocks")) { sim.num_blocks = strtoul(val, NULL, 0); geometry_set = 1; }
+		else if (!strcmp(tok, "planes")) sim.planes = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "page")) { sim.page_size = strtoul(val, NULL, 0); geometry_set = 1; }
+		else if (!strcmp(tok, "spare")) { sim.spare_size = strtoul(val, NULL, 0); geometry_set = 1; }
+		else if (!strcmp(tok, "ppb")) { sim.pages_per_block = strtoul(val, NULL, 0); geometry_set = 1; }
+		else if (!strcmp(tok, "onfi")) sim.onfi = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "latency")) sim.latency = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "tr")) sim.t_read = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "tprog")) sim.t_prog = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "tbers")) sim.t_erase = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "pld")) pld = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "coalesce")) sim.coalesce = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "buffer")) sim.buffer = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "flip")) sim.flip = strtoul(val, NULL, 0);
+		else if (!strcmp(tok, "flipbits")) sim.flip_bits = strtoul(val, NULL, 0);
+		else {
+			fprintf(stderr, "sim: unknown setting '%s'\n", tok);
+			free(copy);
+			return NULL;
+		}
+	}
+	free(copy);
+
+	if (sim.num_chips < 1 || sim.num_chips > SIM_CHIPS_MAX) {
+		fprintf(stderr, "sim: chips must be 1 or %d\n", SIM_CHIPS_MAX);
+		return NULL;
+	}
+	/* "NAND Programmer" / "2 NAND Programmer" */
+	sim.pld_id = pld >= 0 ? pld : sim.num_chips > 1 ? 5 : 4;
+
+	/* K9F1G08 (f1): 1024 blocks of 64 2K pages, one plane; K9GAG08 (d5):
+	   4096 blocks of 128 4K pages; the 512MB parts: 4096 blocks of 64 2K
+	   pages */
+	if (!sim.page_size) sim.page_size = (id & 0xff) == 0xd5 ? 4096 : 2048;
+	if (!sim.spare_size) sim.spare_size = sim.page_size / 32;
+	if (!sim.pages_per_block) sim.pages_per_block = (id & 0xff) == 0xd5 ? 128 : 64;
+	if (!sim.num_blocks) sim.num_blocks = (id & 0xff) == 0xf1 ? 1024 : 4096;
+	if (!sim.planes) sim.planes = (id & 0xff) == 0xf1 ? 1 : 2;
+	sim.page_len = sim.page_size + sim.spare_size;
+	if (sim.page_len > SIM_PAGE_LEN_MAX || sim.page_size < 1024 || sim.page_size % 512) {
+		fprintf(stderr, "sim: pages of %d+%d bytes aren't supported\n",
+			sim.page_size, sim.spare_size);
+		return NULL;
+	}
+	sim_make_id(id);
+	if (sim.onfi < 0) sim.onfi = geometry_set;
+	if (sim.onfi) sim_make_params();
+
+	for (n = 0; n < sim.num_chips; n++)
+		if (!err) err = sim_open_chip(&sim.chip[n], filename[n], bad[n]);
+	for (n = 0; n < SIM_CHIPS_MAX; n++) {
+		free(filename[n]);
+		free(bad[n]);
+	}
+	if (err) return NULL;
+	sim.cur = &sim.chip[0];
+
+	printf("Simulated Infectus: ID %02x%02x, %d x %u blocks of %d+%d x %d, %s backing, %uus latency\n",
+		sim.id[0], sim.id[1], sim.num_chips, sim.num_blocks,
+		sim.page_size, sim.spare_size, sim.pages_per_block,
+		sim.chip[0].fp ? "file" : "memory", sim.latency);
+	return &sim_transport;
+}
@@ -0,0 +1,241 @@
+/*
+amoxiflash -- NAND Flash chip programmer utility, using the Infectus 1 / 2 chip
+Copyright (C) 2008  bushing
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Subpage size tuning.  The Infectus buffer is somewhere between 700 and
+   1056 bytes and differs between units, so the tune command tries every
+   useful transfer size on one block, keeps the fastest one that moved the
+   data intact, and remembers it in ~/.amoxiflash-tune for this device and
+   firmware.  Later runs pick it up unless -b is given. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "amoxiflash.h"
+
+#define TUNE_ROUNDS 2
+#define TUNE_FILE ".amoxiflash-tune"
+
+/* The sizes worth trying are the smallest that move a page in n chunks,
+   rounded up to 8 bytes: anything in between costs as many transfers as
+   the next size up.  For a 2112-byte page, n = 8..1 gives 0x108 .. 0x840;
+   bigger pages take more chunks for the same range of sizes. */
+#define TUNE_SIZE_MIN 0x108
+#define TUNE_SIZES_MAX 64
+static int tune_sizes[TUNE_SIZES_MAX];
+
+static int tune_list_sizes(void) {
+	int page_len = page_size + spare_size, n, size, count = 0;
+	for (n = (page_len + TUNE_SIZE_MIN - 1) / TUNE_SIZE_MIN; n >= 1 && count < TUNE_SIZES_MAX; n--) {
+		size = ((page_len + n - 1) / n + 7) & ~7;
+		if (size > SUBPAGE_MAX) break;
+		if (count && size == tune_sizes[count - 1]) continue;
+		tune_sizes[count++] = size;
+	}
+	return count;
+}
+
+/* the size the official software uses; assumed to work everywhere */
+#define TUNE_SAFE_SIZE 0x210
+
+static unsigned long long tune_now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static char *tune_path(void) {
+	static char path[1024];
+	const char *home = getenv("HOME");
+	snprintf(path, sizeof path, "%s/%s", home ? home : ".", TUNE_FILE);
+	return path;
+}
+
+/* What a tuned size is stored against: device and firmware */
+static void tune_key(char *key, int len) {
+	char *p;
+	snprintf(key, len, "%s rev=%02x loader=%u.%u pld=%u", device_id,
+		infectus_revision, infectus_loader >> 8, infectus_loader & 0xff, infectus_pld);
+	/* the device name is the first field, so it can't contain spaces */
+	for (p = key; *p && p < key + strlen(device_id); p++)
+		if (*p == ' ') *p = '_';
+}
+
+/* Set subpage_size from the tuning file, if this device has been tuned */
+int tune_lookup(void) {
+	char key[256], line[300];
+	int n, size = 0;
+	FILE *fp;
+
+	tune_key(key, sizeof key);
+	n = strlen(key);
+	if (!(fp = fopen(tune_path(), "r"))) return 0;
+	while (fgets(line, sizeof line, fp))
+		if (!strncmp(line, key, n) && line[n] == ' ')
+			size = strtol(line + n + 1, NULL, 0);
+	fclose(fp);
+
+	if (size <= 0 || size > SUBPAGE_MAX) return 0;
+	subpage_size = size;
+	printf("Using tuned block size 0x%x\n", subpage_size);
+	return 1;
+}
+
+static int tune_store(int size) {
+	char key[256], line[300];
+	char *lines = NULL;
+	size_t used = 0;
+	int n;
+	FILE *fp;
+
+	tune_key(key, sizeof key);
+	n = strlen(key);
+
+	/* keep every other device's entry */
+	if ((fp = fopen(tune_path(), "r"))) {
+		while (fgets(line, sizeof line, fp)) {
+			if (!strncmp(line, key, n) && line[n] == ' ') continue;
+			lines = realloc(lines, used + strlen(line) + 1);
+			strcpy(lines + used, line);
+			used += strlen(line);
+		}
+		fclose(fp);
+	}
+
+	if (!(fp = fopen(tune_path(), "w"))) {
+		perror("Couldn't save tuning");
+		free(lines);
+		return -1;
+	}
+	if (lines) fputs(lines, fp);
+	fprintf(fp, "%s 0x%x\n", key, size);
+	fclose(fp);
+	free(lines);
+	return 0;
+}
+
+static int tune_read_block(u8 *buf, u32 first_page) {
+	int pageno;
+	for (pageno = 0; pageno < pages_per_block; pageno++)
+		if (infectus_readflashpage(buf + pageno * pagebuf_size, first_page + pageno)
+		    < page_size + spare_size) return -1;
+	return 0;
+}
+
+static int tune_same(u8 *a, u8 *b) {
+	int pageno;
+	for (pageno = 0; pageno < pages_per_block; pageno++)
+		if (memcmp(a + pageno * pagebuf_size, b + pageno * pagebuf_size, page_size + spare_size))
+			return 0;
+	return 1;
+}
+
+static void tune_write_block(u8 *buf, u32 blockno) {
+	u32 first_page = blockno * pages_per_block;
+	int pageno;
+
+	infectus_eraseblock(blockno);
+	for (pageno = 0; pageno < pages_per_block; pageno++) {
+		if (flash_isFF(buf + pageno * pagebuf_size, page_size + spare_size)) continue;
+		infectus_writeflashpage(buf + pageno * pagebuf_size, first_page + pageno);
+	}
+}
+
+/* Try each candidate size on block blockno.  Reads must return what a read
+   at TUNE_SAFE_SIZE returns; unless in test mode, a pattern written at the
+   candidate size must also read back intact.  The block's contents are put
+   back afterwards. */
+int tune_subpage_size(u32 blockno) {
+	int block_bytes = pages_per_block * pagebuf_size;
+	u8 *saved = malloc(block_bytes), *pattern = malloc(block_bytes), *buf = malloc(block_bytes);
+	u8 *ref = malloc(block_bytes);	/* what the block holds now */
+	u32 first_page = blockno * pages_per_block;
+	unsigned long long t, t_read, t_write, best_time = 0;
+	int orig_size = subpage_size, best = 0, i, round, ok, wrote = 0;
+	int num_sizes = tune_list_sizes();
+	float kb = pages_per_block * (page_size + spare_size) / 1024.0f;
+
+	printf("Tuning block size on block %04x%s\n", blockno,
+		test_mode ? " (test mode: reads only)" : "");
+
+	subpage_size = TUNE_SAFE_SIZE;
+	if (tune_read_block(saved, first_page) || tune_read_block(buf, first_page) ||
+	    !tune_same(saved, buf)) {
+		printf("Block %04x doesn't read back consistently at 0x%x; pick another with -s\n",
+			blockno, TUNE_SAFE_SIZE);
+		subpage_size = orig_size;
+		free(saved); free(pattern); free(buf); free(ref);
+		return 1;
+	}
+	memcpy(ref, saved, block_bytes);
+
+	for (i = 0; i < block_bytes; i++) pattern[i] = rand();
+
+	printf("  size     read KB/s  write KB/s\n");
+	for (i = 0; i < num_sizes; i++) {
+		subpage_size = tune_sizes[i];
+		printf("  0x%03x  ", subpage_size); fflush(stdout);
+
+		ok = 1;
+		t = tune_now();
+		for (round = 0; round < TUNE_ROUNDS && ok; round++)
+			if (tune_read_block(buf, first_page) || !tune_same(ref, buf)) ok = 0;
+		t_read = (tune_now() - t) / TUNE_ROUNDS;
+		if (ok) printf("%10.1f  ", kb * 1000000.0f / t_read);
+		else printf("%10s  ", "-");
+
+		t_write = 0;
+		if (ok && !test_mode) {
+			t = tune_now();
+			tune_write_block(pattern, blockno);
+			t_write = tune_now() - t;
+			wrote = 1;
+			/* check it with a size known to work */
+			subpage_size = TUNE_SAFE_SIZE;
+			if (tune_read_block(ref, first_page) || !tune_same(pattern, ref)) ok = 0;
+			subpage_size = tune_sizes[i];
+			if (ok) printf("%10.1f", kb * 1000000.0f / t_write);
+			else printf("%10s", "-");
+		}
+		printf("  %s\n", ok ? "" : "FAILED");
+
+		if (ok && (!best || t_read + t_write < best_time)) {
+			best = tune_sizes[i];
+			best_time = t_read + t_write;
+		}
+	}
+
+	if (wrote) {
+		printf("Restoring block %04x\n", blockno);
+		subpage_size = TUNE_SAFE_SIZE;
+		tune_write_block(saved, blockno);
+		if (tune_read_block(buf, first_page) || !tune_same(saved, buf))
+			printf("WARNING: block %04x did not restore cleanly\n", blockno);
+	}
+	free(saved); free(pattern); free(buf); free(ref);
+
+	if (!best) {
+		printf("No block size worked\n");
+		subpage_size = orig_size;
+		return 1;
+	}
+	subpage_size = best;
+	printf("Best block size: 0x%x\n", best);
+	if (tune_store(best) == 0) printf("Saved in %s\n", tune_path());
+	return 0;
+}